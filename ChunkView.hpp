@@ -0,0 +1,156 @@
+#pragma once
+
+/*
+ * ChunkView -- reads a chunk file (see read_write_chunk.hpp) in place,
+ *  through a memory mapping.
+ *
+ * Chunks are viewed as typed spans that point straight into the mapping, so
+ *  loading allocates and copies nothing. The spans stay valid as long as the
+ *  ChunkView does (moving it is fine: the mapping stays put).
+ *
+ * next() views chunks in file order; find() goes straight to a chunk by its
+ *  magic number, so only the chunks that are used are ever paged in. find()
+ *  uses the file's table of contents if it has one, and otherwise reads
+ *  every chunk header once (but no payloads) to make one. After find(),
+ *  next() carries on from the chunk after the one found (like seeking a
+ *  stream), so chunks can be found by name and then read in order.
+ *
+ * Usage:
+ *   ChunkView view(path);
+ *   Span< Vertex const > vertices = view.next< Vertex >("pnct");
+ *   glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_STATIC_DRAW);
+ *   Span< CameraEntry const > cameras = view.find< CameraEntry >("cam0");
+ *
+ * Both v1 and v2 files are accepted. v2 payloads are aligned, but v1 payloads
+ *  may not be aligned for their type (e.g., after an odd-sized string chunk);
+ *  those chunks are copied into storage owned by the ChunkView instead.
+ *  Compressed chunks (see compressed_chunk.hpp) can't be viewed in place;
+ *  a ChunkView given an inflater inflates them into storage it owns, too
+ *  (other chunks in the file are still viewed in place), and one without
+ *  refuses them:
+ *   ChunkView view(path, inflate_chunk_copy); //(from compressed_chunk.hpp)
+ *
+ */
+
+#include "MappedFile.hpp"
+#include "read_write_chunk.hpp"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+//inflates a compressed chunk's payload into storage of its own, and returns the inflated bytes
+// (passed to ChunkView, so that only code that reads compressed chunks needs zlib):
+typedef Span< char const > (*ChunkInflater)(Span< char const > payload, std::unique_ptr< char[] > *storage);
+
+struct ChunkView {
+	//map the file at 'path' and read its file header (and table of contents, if any); throws std::runtime_error on failure:
+	// (compressed chunks are inflated with 'inflater', if given)
+	explicit ChunkView(std::string const &path_, ChunkInflater inflater_ = nullptr) : file(path_), path(path_), inflater(inflater_) {
+		at = file.data;
+		end = file.data + file.size;
+		format = view_chunk_file_header(&at, end);
+		if (format.version != 1 && size_t(end - at) >= 4 && std::string(at, 4) == "toc0") {
+			toc = view_chunk< ChunkTocEntry >(&at, end, "toc0", format);
+		}
+		first = at;
+	}
+
+	//view the next chunk, which must have the given magic number; throws std::runtime_error if it doesn't,
+	// or if the chunk is malformed (or fails its checksum):
+	template< typename T >
+	Span< T const > next(std::string const &magic) {
+		return typed< T >(view(&at, magic));
+	}
+
+	//view the first chunk with the given magic number, wherever it is in the file; next() then views the chunk after it:
+	// throws std::runtime_error if there isn't one
+	template< typename T >
+	Span< T const > find(std::string const &magic) {
+		char const *chunk = locate(magic);
+		if (!chunk) {
+			throw std::runtime_error("Chunk '" + magic + "' isn't in '" + path + "'.");
+		}
+		Span< T const > data = typed< T >(view(&chunk, magic));
+		at = chunk;
+		return data;
+	}
+
+	//is there a chunk with the given magic number?
+	bool has(std::string const &magic) { return locate(magic) != nullptr; }
+
+	//have all of the chunks been viewed (by next())?
+	bool at_end() const { return at == end; }
+
+	MappedFile file;
+	std::string path;
+	ChunkInflater inflater = nullptr;
+	ChunkFormat format;
+	Span< ChunkTocEntry const > toc; //the file's table of contents (empty if it has none)
+
+	//-- internals --
+	char const *at = nullptr; //start of the next chunk (for next())
+	char const *end = nullptr;
+	char const *first = nullptr; //start of the first chunk after the table of contents
+	std::vector< ChunkTocEntry > index; //made by reading chunk headers, for files without a table of contents
+	bool indexed = false;
+	std::vector< std::unique_ptr< char[] > > copies; //(of misaligned v1 chunks, and inflated compressed chunks)
+
+	//the bytes of the chunk at *at_ (in place, unless it is compressed), advancing *at_ past it:
+	Span< char const > view(char const **at_, std::string const &magic) {
+		if (!(format.flags & ChunkFormat::ChunkCompression)) {
+			return view_chunk_data(at_, end, magic, format);
+		}
+		char const *after = *at_;
+		ChunkExtent extent = view_chunk_extent(&after, end, magic, format);
+		Span< char const > data(extent.data, size_t(extent.size));
+		if (extent.compressed) {
+			if (!inflater) {
+				throw std::runtime_error("Chunk '" + magic + "' in '" + path + "' is compressed, and this ChunkView can't inflate it.");
+			}
+			copies.emplace_back();
+			data = inflater(data, &copies.back());
+		}
+		*at_ = after;
+		return data;
+	}
+
+	char const *locate(std::string const &magic) {
+		if (!indexed) {
+			if (toc.empty()) {
+				//no table of contents, so skip through the file a header at a time:
+				char const *scan = first;
+				while (scan < end) {
+					ChunkExtent extent = chunk_extent(scan, end, format);
+					ChunkTocEntry entry;
+					std::memcpy(entry.magic, extent.magic, 4);
+					entry.offset = uint64_t(scan - file.data);
+					entry.size = extent.size;
+					index.emplace_back(entry);
+					scan = extent.data + extent.size;
+				}
+			} else {
+				index.assign(toc.begin(), toc.end());
+			}
+			indexed = true;
+		}
+		for (ChunkTocEntry const &entry : index) {
+			if (std::string(entry.magic, 4) == magic && entry.offset < file.size) return file.data + entry.offset;
+		}
+		return nullptr;
+	}
+
+	template< typename T >
+	Span< T const > typed(Span< char const > data) {
+		if (data.size() % sizeof(T) != 0) {
+			throw std::runtime_error("Size of chunk not divisible by element size");
+		}
+		if (reinterpret_cast< uintptr_t >(data.data()) % alignof(T) != 0) {
+			static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__, "copies are aligned by operator new[]");
+			copies.emplace_back(new char[data.size()]);
+			std::memcpy(copies.back().get(), data.data(), data.size());
+			return Span< T const >(reinterpret_cast< T const * >(copies.back().get()), data.size() / sizeof(T));
+		}
+		return Span< T const >(reinterpret_cast< T const * >(data.data()), data.size() / sizeof(T));
+	}
+};
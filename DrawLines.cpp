@@ -1,67 +1,61 @@
 #include "DrawLines.hpp"
 #include "PathFont.hpp"
 #include "ColorProgram.hpp"
+#include "StreamBuffer.hpp"
 
 #include "gl_errors.hpp"
 
 #include <glm/gtc/type_ptr.hpp>
 
-//All DrawLines instances share a vertex array object and vertex buffer, initialized at load time:
+//All DrawLines instances share a vertex array object, initialized at load time;
+// vertices are uploaded to the shared StreamBuffer:
 
 //n.b. declared static so they don't conflict with similarly named global variables elsewhere:
-static GLuint vertex_buffer = 0;
 static GLuint vertex_buffer_for_color_program = 0;
 
 static Load< void > setup_buffers(LoadTagDefault, [](){
 	//you may recognize this init code from DrawSprites.cpp:
 
-	{ //set up vertex buffer:
-		glGenBuffers(1, &vertex_buffer);
-		//for now, buffer will be un-filled.
-	}
-
 	{ //vertex array mapping buffer for color_program:
 		//ask OpenGL to fill vertex_buffer_for_color_program with the name of an unused vertex array object:
 		glGenVertexArrays(1, &vertex_buffer_for_color_program);
-
-		//set vertex_buffer_for_color_program as the current vertex array object:
-		glBindVertexArray(vertex_buffer_for_color_program);
-
-		//set vertex_buffer as the source of glVertexAttribPointer() commands:
-		glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
-
-		//set up the vertex array object to describe arrays of PongMode::Vertex:
-		glVertexAttribPointer(
-			color_program->Position_vec4, //attribute
-			3, //size
-			GL_FLOAT, //type
-			GL_FALSE, //normalized
-			sizeof(DrawLines::Vertex), //stride
-			(GLbyte *)0 + offsetof(DrawLines::Vertex, Position) //offset
-		);
-		glEnableVertexAttribArray(color_program->Position_vec4);
-		//[Note that it is okay to bind a vec3 input to a vec4 attribute -- the w component will be filled with 1.0 automatically]
-
-		glVertexAttribPointer(
-			color_program->Color_vec4, //attribute
-			4, //size
-			GL_UNSIGNED_BYTE, //type
-			GL_TRUE, //normalized
-			sizeof(DrawLines::Vertex), //stride
-			(GLbyte *)0 + offsetof(DrawLines::Vertex, Color) //offset
-		);
-		glEnableVertexAttribArray(color_program->Color_vec4);
-
-		//done referring to vertex_buffer, so unbind it:
-		glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-		//done setting up vertex array object, so unbind it:
-		glBindVertexArray(0);
+		//(attributes are pointed at the uploaded vertices when drawing, since they move around in the stream buffer)
 	}
 
 	GL_ERRORS(); //PARANOIA: make sure nothing strange happened during setup
 });
 
+//point color_program's attributes at vertices stored at 'offset' in 'buffer' (the vertex array object should already be bound):
+static void bind_attributes(GLuint buffer, GLintptr offset) {
+	//set buffer as the source of glVertexAttribPointer() commands:
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+
+	//set up the vertex array object to describe arrays of DrawLines::Vertex:
+	glVertexAttribPointer(
+		color_program->Position_vec4, //attribute
+		3, //size
+		GL_FLOAT, //type
+		GL_FALSE, //normalized
+		sizeof(DrawLines::Vertex), //stride
+		(GLbyte *)0 + offset + offsetof(DrawLines::Vertex, Position) //offset
+	);
+	glEnableVertexAttribArray(color_program->Position_vec4);
+	//[Note that it is okay to bind a vec3 input to a vec4 attribute -- the w component will be filled with 1.0 automatically]
+
+	glVertexAttribPointer(
+		color_program->Color_vec4, //attribute
+		4, //size
+		GL_UNSIGNED_BYTE, //type
+		GL_TRUE, //normalized
+		sizeof(DrawLines::Vertex), //stride
+		(GLbyte *)0 + offset + offsetof(DrawLines::Vertex, Color) //offset
+	);
+	glEnableVertexAttribArray(color_program->Color_vec4);
+
+	//done referring to buffer, so unbind it:
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
 
 DrawLines::DrawLines(glm::mat4 const &world_to_clip_) : world_to_clip(world_to_clip_) {
 }
@@ -137,10 +131,9 @@ DrawLines::~DrawLines() {
 
 	//based on DrawSprites.cpp :
 
-	//upload vertices to vertex_buffer:
-	glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer); //set vertex_buffer as current
-	glBufferData(GL_ARRAY_BUFFER, attribs.size() * sizeof(attribs[0]), attribs.data(), GL_STREAM_DRAW); //upload attribs array
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	//upload vertices to the stream buffer:
+	StreamBuffer &stream = StreamBuffer::shared();
+	GLintptr offset = stream.upload(attribs.data(), attribs.size() * sizeof(attribs[0]), sizeof(attribs[0]));
 
 	//set color_program as current program:
 	glUseProgram(color_program->program);
@@ -150,6 +143,7 @@ DrawLines::~DrawLines() {
 
 	//use the mapping vertex_buffer_for_color_program to fetch vertex data:
 	glBindVertexArray(vertex_buffer_for_color_program);
+	bind_attributes(stream.buffer, offset);
 
 	//run the OpenGL pipeline:
 	glDrawArrays(GL_LINES, 0, GLsizei(attribs.size()));
@@ -0,0 +1,197 @@
+#include "GlyphAtlas.hpp"
+
+#include "gl_errors.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+GlyphAtlas::GlyphAtlas(FT_Face face_, Mode mode_, uint32_t initial_size, uint32_t max_size_) : mode(mode_), face(face_), max_size(max_size_) {
+	assert(face);
+	assert(initial_size > 0 && initial_size <= max_size);
+
+	if (mode == SDF && !GLYPH_ATLAS_SDF_SUPPORTED) {
+		std::cerr << "WARNING: this FreeType can't generate signed distance fields; using a coverage atlas instead." << std::endl;
+		mode = Coverage;
+	}
+
+	glGenTextures(1, &tex);
+	glBindTexture(GL_TEXTURE_2D, tex);
+	if (mode == SDF) {
+		//distance fields are meant to be interpolated:
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	} else {
+		//make the texture have sharp pixels when magnified:
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	}
+	//when access past the edge, clamp to the edge:
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	glGenTextures(1, &rect_tex);
+	glBindTexture(GL_TEXTURE_2D, rect_tex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16UI, RectTableWidth, MaxRects / RectTableWidth, 0, GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, nullptr);
+	//integer textures can't be filtered:
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	resize(glm::uvec2(initial_size));
+}
+
+GlyphAtlas::~GlyphAtlas() {
+	if (tex != 0) {
+		glDeleteTextures(1, &tex);
+		tex = 0;
+	}
+	if (rect_tex != 0) {
+		glDeleteTextures(1, &rect_tex);
+		rect_tex = 0;
+	}
+}
+
+GlyphAtlas::Glyph GlyphAtlas::get(uint32_t glyph_id) {
+	auto f = glyphs.find(glyph_id);
+	if (f != glyphs.end()) return f->second;
+
+	Glyph glyph;
+
+	FT_Int32 load_flags = FT_LOAD_DEFAULT;
+	FT_Render_Mode render_mode = FT_RENDER_MODE_NORMAL;
+	#if GLYPH_ATLAS_SDF_SUPPORTED
+	if (mode == SDF) {
+		//distance fields get scaled when drawn, so hinting for the atlas size doesn't help:
+		load_flags = FT_LOAD_NO_HINTING;
+		render_mode = FT_RENDER_MODE_SDF;
+	}
+	#endif
+
+	if (FT_Load_Glyph(face, glyph_id, load_flags) || FT_Render_Glyph(face->glyph, render_mode)) {
+		std::cerr << "WARNING: failed to rasterize glyph " << glyph_id << "; it will be drawn as empty space." << std::endl;
+		glyphs.emplace(glyph_id, glyph);
+		return glyph;
+	}
+
+	FT_Bitmap const &bitmap = face->glyph->bitmap;
+	glyph.size = glm::ivec2(bitmap.width, bitmap.rows);
+	glyph.bearing = glm::ivec2(face->glyph->bitmap_left, face->glyph->bitmap_top - int(bitmap.rows));
+
+	//glyphs with no pixels (e.g., spaces) don't need any room in the texture:
+	if (glyph.size.x == 0 || glyph.size.y == 0) {
+		glyphs.emplace(glyph_id, glyph);
+		return glyph;
+	}
+
+	if (rect_count == MaxRects) evict();
+	glyph.position = allocate(glyph.size.x + 2 * padding, glyph.size.y + 2 * padding) + glm::ivec2(padding);
+	glyph.rect = rect_count++;
+
+	//copy bitmap (stored top-to-bottom) into the texture (stored bottom-to-top):
+	for (int r = 0; r < glyph.size.y; ++r) {
+		uint8_t const *src = bitmap.buffer + r * bitmap.pitch;
+		uint8_t *dst = &pixels[(glyph.position.y + glyph.size.y - 1 - r) * size.x + glyph.position.x];
+		std::copy(src, src + glyph.size.x, dst);
+	}
+
+	//upload just the changed rectangle:
+	glBindTexture(GL_TEXTURE_2D, tex);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, size.x);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, glyph.position.x, glyph.position.y, glyph.size.x, glyph.size.y, GL_RED, GL_UNSIGNED_BYTE, &pixels[glyph.position.y * size.x + glyph.position.x]);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+	//...and its rect table entry:
+	glm::u16vec4 rect = glm::u16vec4(glyph.position.x, glyph.position.y, glyph.size.x, glyph.size.y);
+	glBindTexture(GL_TEXTURE_2D, rect_tex);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, glyph.rect % RectTableWidth, glyph.rect / RectTableWidth, 1, 1, GL_RGBA_INTEGER, GL_UNSIGNED_SHORT, &rect);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	GL_ERRORS();
+
+	glyphs.emplace(glyph_id, glyph);
+	return glyph;
+}
+
+glm::ivec2 GlyphAtlas::allocate(uint32_t w, uint32_t h) {
+	if (w > max_size || h > max_size) {
+		throw std::runtime_error("Glyph of size " + std::to_string(w) + "x" + std::to_string(h) + " will never fit in a " + std::to_string(max_size) + "x" + std::to_string(max_size) + " atlas.");
+	}
+
+	glm::ivec2 at;
+	while (!try_allocate(w, h, &at)) {
+		if (size.x < max_size || size.y < max_size) {
+			//grow the shorter side (height first, since that is what new shelves need):
+			if (size.y <= size.x) resize(glm::uvec2(size.x, std::min(size.y * 2, max_size)));
+			else resize(glm::uvec2(std::min(size.x * 2, max_size), size.y));
+		} else {
+			evict();
+		}
+	}
+	return at;
+}
+
+bool GlyphAtlas::try_allocate(uint32_t w, uint32_t h, glm::ivec2 *at) {
+	assert(at);
+
+	//best fit: the existing shelf with room that wastes the least height:
+	Shelf *best = nullptr;
+	for (auto &shelf : shelves) {
+		if (shelf.height < h || shelf.x + w > size.x) continue;
+		if (!best || shelf.height < best->height) best = &shelf;
+	}
+	//...but don't put short glyphs in much taller shelves if a new shelf could be started:
+	uint32_t top = (shelves.empty() ? 0 : shelves.back().y + shelves.back().height);
+	bool room_for_shelf = (top + h <= size.y && w <= size.x);
+	if (best && (best->height <= h + h / 2 || !room_for_shelf)) {
+		*at = glm::ivec2(best->x, best->y);
+		best->x += w;
+		return true;
+	}
+
+	if (!room_for_shelf) return false;
+
+	shelves.emplace_back();
+	shelves.back().y = top;
+	shelves.back().height = h;
+	shelves.back().x = w;
+	*at = glm::ivec2(0, top);
+	return true;
+}
+
+void GlyphAtlas::resize(glm::uvec2 new_size) {
+	std::vector< uint8_t > new_pixels(new_size.x * new_size.y, 0);
+	for (uint32_t y = 0; y < std::min(size.y, new_size.y); ++y) {
+		std::copy(pixels.begin() + y * size.x, pixels.begin() + y * size.x + std::min(size.x, new_size.x), new_pixels.begin() + y * new_size.x);
+	}
+	pixels = std::move(new_pixels);
+	size = new_size;
+
+	glBindTexture(GL_TEXTURE_2D, tex);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, size.x, size.y, 0, GL_RED, GL_UNSIGNED_BYTE, pixels.data());
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	GL_ERRORS();
+}
+
+void GlyphAtlas::evict() {
+	glyphs.clear();
+	shelves.clear();
+	rect_count = 0;
+	std::fill(pixels.begin(), pixels.end(), 0);
+	generation += 1;
+
+	glBindTexture(GL_TEXTURE_2D, tex);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, size.x, size.y, GL_RED, GL_UNSIGNED_BYTE, pixels.data());
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	GL_ERRORS();
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+/*
+ * GlyphAtlas -- glyphs rasterized on demand (by font glyph id) and packed
+ *  into a single-channel texture.
+ *
+ * Glyphs are stored with tight bounds and packed into horizontal shelves.
+ * When the texture fills up it grows (existing glyphs keep their position);
+ * when it can't grow any further, every glyph is evicted and 'generation'
+ * is incremented, which invalidates all previously returned positions.
+ *
+ * Each packed glyph also gets an entry in a rect table texture, so that
+ *  instanced draws can refer to glyphs by a small index.
+ *
+ * In SDF mode, glyphs are stored as signed distance fields (generated by
+ *  FreeType from the glyph outlines; 0.5 is the edge, larger is inside)
+ *  and the texture is linearly filtered, so one atlas can be drawn at any
+ *  scale.
+ *
+ */
+
+#include "GL.hpp"
+
+#include <glm/glm.hpp>
+#include <freetype/freetype.h>
+
+#include <unordered_map>
+#include <vector>
+
+//FT_RENDER_MODE_SDF first appeared in FreeType 2.11:
+#if FREETYPE_MAJOR > 2 || (FREETYPE_MAJOR == 2 && FREETYPE_MINOR >= 11)
+#define GLYPH_ATLAS_SDF_SUPPORTED 1
+#else
+#define GLYPH_ATLAS_SDF_SUPPORTED 0
+#endif
+
+struct GlyphAtlas {
+	enum Mode {
+		Coverage, //8-bit coverage, drawn with nearest filtering
+		SDF, //8-bit signed distance field, drawn with linear filtering
+	};
+
+	//face should already have its size set; it must outlive the atlas:
+	// (SDF mode falls back to Coverage if FreeType is too old to generate distance fields)
+	GlyphAtlas(FT_Face face, Mode mode = Coverage, uint32_t initial_size = 256, uint32_t max_size = 2048);
+	~GlyphAtlas();
+
+	Mode mode = Coverage;
+
+	struct Glyph {
+		glm::ivec2 position = glm::ivec2(0); //lower-left corner of the glyph in the atlas texture (pixels)
+		glm::ivec2 size = glm::ivec2(0); //size of the glyph's bitmap (pixels)
+		glm::ivec2 bearing = glm::ivec2(0); //offset from the pen position to the lower-left corner of the bitmap (pixels)
+		uint32_t rect = 0; //index of (position, size) in the rect table
+	};
+
+	//look up a glyph, rasterizing and packing it if it isn't in the atlas yet:
+	// (returned by value, since packing a new glyph may evict the others)
+	Glyph get(uint32_t glyph_id);
+
+	//texture holding the packed glyphs (R8, coverage or distance in the red channel):
+	GLuint tex = 0;
+	glm::uvec2 size = glm::uvec2(0);
+
+	//rect table of packed glyphs (RGBA16UI; rect i is at texel (i % RectTableWidth, i / RectTableWidth) and holds position.xy, size.xy):
+	enum : uint32_t {
+		RectTableWidth = 256,
+		MaxRects = RectTableWidth * 256
+	};
+	GLuint rect_tex = 0;
+	uint32_t rect_count = 0;
+
+	//incremented every time glyphs are evicted:
+	uint32_t generation = 0;
+
+	//-- internals --
+	FT_Face face = nullptr;
+	uint32_t max_size = 0;
+	uint32_t padding = 1; //empty pixels kept around each glyph
+
+	std::unordered_map< uint32_t, Glyph > glyphs;
+
+	//glyphs are packed left-to-right into shelves, which are stacked bottom-to-top:
+	struct Shelf {
+		uint32_t y = 0;
+		uint32_t height = 0;
+		uint32_t x = 0; //next free x position
+	};
+	std::vector< Shelf > shelves;
+
+	//CPU-side copy of the texture, used when growing:
+	std::vector< uint8_t > pixels;
+
+	//find space for a w x h rectangle, growing or evicting as needed:
+	glm::ivec2 allocate(uint32_t w, uint32_t h);
+	bool try_allocate(uint32_t w, uint32_t h, glm::ivec2 *at);
+	void resize(glm::uvec2 new_size);
+	void evict();
+};
@@ -30,6 +30,7 @@ if (maek.OS === "windows") {
 		`/I${NEST_LIBS}/SDL2/include`,
 		`/I${NEST_LIBS}/glm/include`,
 		`/I${NEST_LIBS}/libpng/include`,
+		`/I${NEST_LIBS}/zlib/include`,
 		`/I${NEST_LIBS}/opusfile/include`,
 		`/I${NEST_LIBS}/libopus/include`,
 		`/I${NEST_LIBS}/libogg/include`,
@@ -60,6 +61,7 @@ if (maek.OS === "windows") {
 		`-I${NEST_LIBS}/SDL2/include/SDL2`, `-D_THREAD_SAFE`, //the output of sdl-config --cflags
 		`-I${NEST_LIBS}/glm/include`,
 		`-I${NEST_LIBS}/libpng/include`,
+		`-I${NEST_LIBS}/zlib/include`,
 		`-I${NEST_LIBS}/opusfile/include`,
 		`-I${NEST_LIBS}/libopus/include`,
 		`-I${NEST_LIBS}/libogg/include`,
@@ -84,6 +86,7 @@ if (maek.OS === "windows") {
 		`-I${NEST_LIBS}/SDL2/include/SDL2`, `-D_THREAD_SAFE`, //the output of sdl-config --cflags
 		`-I${NEST_LIBS}/glm/include`,
 		`-I${NEST_LIBS}/libpng/include`,
+		`-I${NEST_LIBS}/zlib/include`,
 		`-I${NEST_LIBS}/opusfile/include`,
 		`-I${NEST_LIBS}/libopus/include`,
 		`-I${NEST_LIBS}/libogg/include`,
@@ -138,6 +141,8 @@ if (maek.OS === 'windows') {
 //returns objFile: objFileBase + a platform-dependant suffix ('.o' or '.obj')
 const game_names = [
 	maek.CPP('PlayMode.cpp'),
+	maek.CPP('Story.cpp'),
+	maek.CPP('GlyphAtlas.cpp'),
 	maek.CPP('main.cpp'),
 	maek.CPP('LitColorTextureProgram.cpp'),
 	//maek.CPP('ColorTextureProgram.cpp'),  //not used right now, but you might want it
@@ -148,7 +153,7 @@ const game_names = [
 
 const pipeline_names = [
 	maek.CPP('pipeline.cpp'),
-	maek.CPP('PlayMode.cpp'),
+	maek.CPP('Story.cpp'),
 ];
 
 const common_names = [
@@ -156,6 +161,9 @@ const common_names = [
 	maek.CPP('PathFont.cpp'),
 	maek.CPP('PathFont-font.cpp'),
 	maek.CPP('DrawLines.cpp'),
+	maek.CPP('StreamBuffer.cpp'),
+	maek.CPP('WorkerPool.cpp'),
+	maek.CPP('MappedFile.cpp'),
 	maek.CPP('ColorProgram.cpp'),
 	maek.CPP('Scene.cpp'),
 	maek.CPP('Mesh.cpp'),
@@ -178,6 +186,14 @@ const show_scene_names = [
 	maek.CPP('ShowSceneMode.cpp')
 ];
 
+//story-sim needs no graphics, so it doesn't link with the common (GL) objects:
+const story_sim_names = [
+	maek.CPP('story-sim.cpp'),
+	maek.CPP('Story.cpp'),
+	maek.CPP('MappedFile.cpp'),
+	maek.CPP('data_path.cpp')
+];
+
 const freetype_test_names = [
 	maek.CPP('freetype-test.cpp')
 ];
@@ -191,10 +207,12 @@ const pipeline_exe = maek.LINK([...pipeline_names, ...common_names], 'dist/pipel
 const show_meshes_exe = maek.LINK([...show_meshes_names, ...common_names], 'scenes/show-meshes');
 const show_scene_exe = maek.LINK([...show_scene_names, ...common_names], 'scenes/show-scene');
 
+const story_sim_exe = maek.LINK([...story_sim_names], 'dist/story-sim');
+
 const freetype_test_exe = maek.LINK([...freetype_test_names], 'freetype-test');
 
 //set the default target to the game (and copy the readme files):
-maek.TARGETS = [game_exe, pipeline_exe, show_meshes_exe, show_scene_exe, freetype_test_exe, ...copies];
+maek.TARGETS = [game_exe, pipeline_exe, story_sim_exe, show_meshes_exe, show_scene_exe, freetype_test_exe, ...copies];
 
 //the '[targets =] RULE(targets, prerequisites[, recipe])' rule defines a Makefile-style task
 // targets: array of targets the task produces (can include both files and ':abstract targets')
@@ -205,6 +223,12 @@ maek.RULE([':run'], [game_exe], [
 	[game_exe, '--some-command-line-option']
 ]);
 
+//rebuild dist/assets/story with text baked by the pipeline, and check the baked text against the text the game shows:
+// (not part of the default build, since it rewrites the checked-in bundle; run it with 'node Maekfile.js :story')
+maek.RULE([':story'], [pipeline_exe], [
+	[pipeline_exe, '--check-bake']
+]);
+
 //Note that tasks that produce ':abstract targets' are never cached.
 // This is similar to how .PHONY targets behave in make.
 
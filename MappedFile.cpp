@@ -0,0 +1,112 @@
+#include "MappedFile.hpp"
+
+#include <stdexcept>
+#include <utility>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(std::string const &path) {
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		throw std::runtime_error("Failed to open '" + path + "' for mapping.");
+	}
+	file_handle = file;
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size)) {
+		unmap();
+		throw std::runtime_error("Failed to get the size of '" + path + "'.");
+	}
+	size = size_t(file_size.QuadPart);
+	if (size == 0) return; //(empty files can't be mapped, but there's nothing to see anyway)
+
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping == NULL) {
+		unmap();
+		throw std::runtime_error("Failed to map '" + path + "'.");
+	}
+	mapping_handle = mapping;
+
+	data = reinterpret_cast< char const * >(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+	if (!data) {
+		unmap();
+		throw std::runtime_error("Failed to map '" + path + "'.");
+	}
+}
+
+void MappedFile::unmap() {
+	if (data) UnmapViewOfFile(data);
+	if (mapping_handle) CloseHandle(mapping_handle);
+	if (file_handle) CloseHandle(file_handle);
+	data = nullptr;
+	size = 0;
+	mapping_handle = nullptr;
+	file_handle = nullptr;
+}
+
+#else
+
+MappedFile::MappedFile(std::string const &path) {
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw std::runtime_error("Failed to open '" + path + "' for mapping.");
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) != 0) {
+		close(fd);
+		throw std::runtime_error("Failed to get the size of '" + path + "'.");
+	}
+	size = size_t(info.st_size);
+	if (size == 0) { //(empty files can't be mapped, but there's nothing to see anyway)
+		close(fd);
+		return;
+	}
+
+	void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); //(the mapping keeps the file open)
+	if (mapped == MAP_FAILED) {
+		size = 0;
+		throw std::runtime_error("Failed to map '" + path + "'.");
+	}
+	data = reinterpret_cast< char const * >(mapped);
+}
+
+void MappedFile::unmap() {
+	if (data) munmap(const_cast< char * >(data), size);
+	data = nullptr;
+	size = 0;
+}
+
+#endif
+
+MappedFile::~MappedFile() {
+	unmap();
+}
+
+MappedFile::MappedFile(MappedFile &&other) {
+	*this = std::move(other);
+}
+
+MappedFile &MappedFile::operator=(MappedFile &&other) {
+	if (this == &other) return *this;
+	unmap();
+	std::swap(data, other.data);
+	std::swap(size, other.size);
+	#ifdef _WIN32
+	std::swap(file_handle, other.file_handle);
+	std::swap(mapping_handle, other.mapping_handle);
+	#endif
+	return *this;
+}
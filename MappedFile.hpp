@@ -0,0 +1,34 @@
+#pragma once
+
+/*
+ * MappedFile -- a whole file, memory-mapped read-only.
+ *
+ * The mapping (and so any pointer into 'data') lives as long as the
+ *  MappedFile does. Pages are read from disk when they are first touched.
+ *
+ */
+
+#include <cstddef>
+#include <string>
+
+struct MappedFile {
+	MappedFile() = default;
+	//map the file at 'path'; throws std::runtime_error on failure:
+	explicit MappedFile(std::string const &path);
+	~MappedFile();
+
+	MappedFile(MappedFile const &) = delete;
+	MappedFile &operator=(MappedFile const &) = delete;
+	MappedFile(MappedFile &&other);
+	MappedFile &operator=(MappedFile &&other);
+
+	char const *data = nullptr; //page aligned
+	size_t size = 0;
+
+	//-- internals --
+	void unmap();
+	#ifdef _WIN32
+	void *file_handle = nullptr;
+	void *mapping_handle = nullptr;
+	#endif
+};
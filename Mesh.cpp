@@ -1,5 +1,6 @@
 #include "Mesh.hpp"
-#include "read_write_chunk.hpp"
+#include "ChunkView.hpp"
+#include "compressed_chunk.hpp"
 
 #include <glm/glm.hpp>
 
@@ -14,7 +15,9 @@
 MeshBuffer::MeshBuffer(std::string const &filename) {
 	glGenBuffers(1, &buffer);
 
-	std::ifstream file(filename, std::ios::binary);
+	//the file is mapped and its chunks used in place (vertex data goes straight from the mapping to the GPU);
+	// files exported with --compress have their chunks inflated into a copy instead, a block per thread:
+	ChunkView file(filename, inflate_chunk_copy);
 
 	GLuint total = 0;
 
@@ -25,11 +28,11 @@ MeshBuffer::MeshBuffer(std::string const &filename) {
 		glm::vec2 TexCoord;
 	};
 	static_assert(sizeof(Vertex) == 3*4+3*4+4*1+2*4, "Vertex is packed.");
-	std::vector< Vertex > data;
+	Span< Vertex const > data;
 
 	//read + upload data chunk:
 	if (filename.size() >= 5 && filename.substr(filename.size()-5) == ".pnct") {
-		read_chunk(file, "pnct", &data);
+		data = file.next< Vertex >("pnct");
 
 		//upload data:
 		glBindBuffer(GL_ARRAY_BUFFER, buffer);
@@ -47,8 +50,7 @@ MeshBuffer::MeshBuffer(std::string const &filename) {
 		throw std::runtime_error("Unknown file type '" + filename + "'");
 	}
 
-	std::vector< char > strings;
-	read_chunk(file, "str0", &strings);
+	Span< char const > strings = file.next< char >("str0");
 
 	{ //read index chunk, add to meshes:
 		struct IndexEntry {
@@ -57,8 +59,7 @@ MeshBuffer::MeshBuffer(std::string const &filename) {
 		};
 		static_assert(sizeof(IndexEntry) == 16, "Index entry should be packed");
 
-		std::vector< IndexEntry > index;
-		read_chunk(file, "idx0", &index);
+		Span< IndexEntry const > index = file.next< IndexEntry >("idx0");
 
 		for (auto const &entry : index) {
 			if (!(entry.name_begin <= entry.name_end && entry.name_end <= strings.size())) {
@@ -67,7 +68,7 @@ MeshBuffer::MeshBuffer(std::string const &filename) {
 			if (!(entry.vertex_begin <= entry.vertex_end && entry.vertex_end <= total)) {
 				throw std::runtime_error("index entry has out-of-range vertex start/count");
 			}
-			std::string name(&strings[0] + entry.name_begin, &strings[0] + entry.name_end);
+			std::string name(strings.data() + entry.name_begin, strings.data() + entry.name_end);
 			Mesh mesh;
 			mesh.type = GL_TRIANGLES;
 			mesh.start = entry.vertex_begin;
@@ -83,7 +84,7 @@ MeshBuffer::MeshBuffer(std::string const &filename) {
 		}
 	}
 
-	if (file.peek() != EOF) {
+	if (!file.at_end()) {
 		std::cerr << "WARNING: trailing data in mesh file '" << filename << "'" << std::endl;
 	}
 
@@ -8,6 +8,8 @@
 #include "GL.hpp"
 #include "gl_compile_program.hpp"
 #include "read_write_chunk.hpp"
+#include "StreamBuffer.hpp"
+#include "WorkerPool.hpp"
 
 //#include "../nest-libs/windows/glm/include/glm/gtc/type_ptr.hpp"
 //#include "../nest-libs/windows/harfbuzz/include/hb.h"
@@ -20,6 +22,7 @@
 #include <freetype/freetype.h>
 #include <freetype/fttypes.h>
 
+#include <algorithm>
 #include <random>
 #include <stdlib.h>
 #include <stdio.h>
@@ -28,11 +31,65 @@
 #include <vector>
 #include <string>
 #include <fstream>
-#include <filesystem>
 
 Load< PlayMode::PPUTileProgram > tile_program(LoadTagEarly); //will 'new PPUTileProgram()' by default
+Load< PlayMode::PPUTileProgram > sdf_tile_program(LoadTagEarly, []() {
+	return new PlayMode::PPUTileProgram(PlayMode::PPUTileProgram::SDF);
+});
 Load< PlayMode::PPUDataStream > data_stream(LoadTagDefault);
 
+//helper to point the tile program's attributes at the unit quad and a buffer of PPUDataStream::GlyphInstance (the vertex array object should already be bound):
+// (instances are read starting at first_instance, since GL 3.3 has no base instance for instanced draws)
+static void bind_tile_attributes(GLuint quad_buffer, GLuint instance_buffer, size_t first_instance = 0) {
+	glBindBuffer(GL_ARRAY_BUFFER, quad_buffer);
+
+	glVertexAttribPointer(
+		tile_program->Corner_vec2, //attribute
+		2, //size
+		GL_UNSIGNED_BYTE, //type
+		GL_FALSE, //normalized
+		sizeof(glm::u8vec2), //stride
+		(GLbyte*)0 //offset
+	);
+	glEnableVertexAttribArray(tile_program->Corner_vec2);
+
+	glBindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+	const GLbyte* first = (GLbyte*)0 + first_instance * sizeof(PlayMode::PPUDataStream::GlyphInstance);
+
+	//the "I" variant binds to an integer attribute:
+	glVertexAttribIPointer(
+		tile_program->Position_ivec2, //attribute
+		2, //size
+		GL_INT, //type
+		sizeof(PlayMode::PPUDataStream::GlyphInstance), //stride
+		first + offsetof(PlayMode::PPUDataStream::GlyphInstance, Position) //offset
+	);
+	glEnableVertexAttribArray(tile_program->Position_ivec2);
+	glVertexAttribDivisor(tile_program->Position_ivec2, 1);
+
+	glVertexAttribIPointer(
+		tile_program->Rect_uint, //attribute
+		1, //size
+		GL_UNSIGNED_SHORT, //type
+		sizeof(PlayMode::PPUDataStream::GlyphInstance), //stride
+		first + offsetof(PlayMode::PPUDataStream::GlyphInstance, Rect) //offset
+	);
+	glEnableVertexAttribArray(tile_program->Rect_uint);
+	glVertexAttribDivisor(tile_program->Rect_uint, 1);
+
+	glVertexAttribIPointer(
+		tile_program->Palette_uint, //attribute
+		1, //size
+		GL_UNSIGNED_BYTE, //type
+		sizeof(PlayMode::PPUDataStream::GlyphInstance), //stride
+		first + offsetof(PlayMode::PPUDataStream::GlyphInstance, Palette) //offset
+	);
+	glEnableVertexAttribArray(tile_program->Palette_uint);
+	glVertexAttribDivisor(tile_program->Palette_uint, 1);
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
 PlayMode::PlayMode() {
 	// Adapted from Harfbuzz example linked on assignment page
 	// This font was obtained from https://fonts.google.com/specimen/Roboto
@@ -51,16 +108,16 @@ PlayMode::PlayMode() {
 	// Create hb-ft font.
 	hb_font = hb_ft_font_create(ft_face, NULL);
 
-	// Determine a fixed size and baseline for all character tiles
+	// Determine the line metrics used to size text (glyph metrics are enough; nothing needs to be rasterized)
 	for (size_t i = min_char; i <= max_char; i++) {
 		FT_UInt glyph_index = FT_Get_Char_Index(ft_face, (char)i);
 		FT_Load_Glyph(ft_face, glyph_index, FT_LOAD_DEFAULT);
-		FT_Render_Glyph(ft_face->glyph, FT_RENDER_MODE_NORMAL);
+		const FT_Glyph_Metrics& metrics = ft_face->glyph->metrics;
 
-		uint32_t w = ft_face->glyph->bitmap.width + ft_face->glyph->bitmap_left;
+		uint32_t w = (uint32_t)((metrics.horiBearingX + metrics.width + 63) / 64);
 
-		int top = ft_face->glyph->bitmap_top;
-		int bottom = ft_face->glyph->bitmap.rows - top;
+		int top = (int)((metrics.horiBearingY + 63) / 64);
+		int bottom = (int)((metrics.height - metrics.horiBearingY + 63) / 64);
 
 		if (w > char_width) {
 			char_width = w;
@@ -74,96 +131,245 @@ PlayMode::PlayMode() {
 	}
 	char_height = char_top + char_bottom;
 
-	//interpret tiles and build a 1 x num_chars color texture (adapated from PPU466)
-	std::vector<glm::u8vec4> data;
-	data.resize(num_chars * char_width * char_height);
-	for (uint32_t i = 0; i < num_chars; i++) {
-		FT_UInt glyph_index = FT_Get_Char_Index(ft_face, (char)(min_char + i));
-		FT_Load_Glyph(ft_face, glyph_index, FT_LOAD_DEFAULT);
-		FT_Render_Glyph(ft_face->glyph, FT_RENDER_MODE_NORMAL);
+	// Glyphs are rasterized into the atlas the first time they are drawn.
+	// A distance field atlas uses its own face, so that it can be rasterized at a different size than text is shaped at.
+	if (sdf_text && GLYPH_ATLAS_SDF_SUPPORTED) {
+		if (FT_New_Face(ft_library, fontfile, 0, &ft_atlas_face))
+			abort();
+		if (FT_Set_Char_Size(ft_atlas_face, sdf_font_size * 64, sdf_font_size * 64, 0, 0))
+			abort();
+		glyph_atlas = std::make_unique< GlyphAtlas >(ft_atlas_face, GlyphAtlas::SDF);
+		atlas_font_size = sdf_font_size;
+	} else {
+		sdf_text = false;
+		glyph_atlas = std::make_unique< GlyphAtlas >(ft_face);
+		atlas_font_size = font_size;
+	}
+	glyph_scale = (float)font_size / char_height * font_size / atlas_font_size;
+
+	// Text is laid out on a pool of workers, each shaping with its own face and Harfbuzz font
+	// (faces are created here, since the FreeType library can't be used from several threads at once)
+	layout_pool = std::make_unique< WorkerPool >();
+	shapers.resize(layout_pool->slots());
+	for (size_t i = 0; i < shapers.size(); i++) {
+		Shaper& shaper = shapers[i];
+		if (i == mainSlot()) {
+			shaper.ft_face = ft_face;
+			shaper.hb_font = hb_font;
+		} else {
+			if (FT_New_Face(ft_library, fontfile, 0, &shaper.ft_face))
+				abort();
+			if (FT_Set_Char_Size(shaper.ft_face, font_size * 64, font_size * 64, 0, 0))
+				abort();
+			shaper.hb_font = hb_ft_font_create(shaper.ft_face, NULL);
+		}
+		shaper.hb_buffer = hb_buffer_create();
+	}
 
-		//location of tile in the texture:
-		uint32_t ox = i * char_width;
+	// The story bundle is mapped and used in place
+	story = std::make_unique< Story >(data_path("assets/story"));
+	playthrough = std::make_unique< Playthrough >(*story);
+	session_path = data_path("session");
+	Playthrough::View view;
+	bool resumed = playthrough->resume(session_path, &view);
+	state_status = std::vector<std::atomic<uint8_t>>(story->states.size());
+	baked_text = story->baked(fontfilestring, font_size);
+	if (story->font_hash != 0 && !baked_text) {
+		std::cerr << "NOTE: story text was baked for a different font or size, so it will be shaped as it is shown." << std::endl;
+	}
 
-		//copy tile indices into texture:
-		for (int y = 0; y < (int)char_height; y++) {
-			for (int x = 0; x < (int)char_width; x++) {
-				int bitmap_x = x - ft_face->glyph->bitmap_left;
-				int bitmap_baseline = ft_face->glyph->bitmap_top;
-				int from_baseline = y - char_bottom;
-				int bitmap_y = bitmap_baseline - from_baseline;
+	// Compiled trigger ids are interned first, so trigger phrases found in text get the same ids
+	for (std::string_view name : story->trigger_names) {
+		internTrigger(std::string(name));
+	}
 
-				if (bitmap_x >= 0 && bitmap_x < (int)ft_face->glyph->bitmap.width && bitmap_y >= 0 && bitmap_y < (int)ft_face->glyph->bitmap.rows) {
-					data[ox + x + (char_width * num_chars) * y] = glm::u8vec4(0xff, 0xff, 0xff, ft_face->glyph->bitmap.buffer[bitmap_x + ft_face->glyph->bitmap.width * bitmap_y]);
-				}
-				else {
-					data[ox + x + (char_width * num_chars) * y] = glm::u8vec4(0, 0, 0, 0);
-				}
-			}
-		}
+	// Build the palette texture
+	std::vector< glm::u8vec4 > palette(256, glm::u8vec4(0xff));
+	palette[PaletteDefault] = default_color;
+	palette[PaletteTrigger] = trigger_color;
+	palette[PaletteDate] = date_color;
+	palette[PaletteTimelineIndex] = timeline_index_color;
+	if (story->speakers.size() > palette.size() - PaletteSpeakers) {
+		throw std::runtime_error("Story has more speakers than fit in the palette.");
 	}
-	glBindTexture(GL_TEXTURE_2D, data_stream->tile_tex);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, char_width * num_chars, char_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data.data());
+	for (size_t i = 0; i < story->speakers.size(); i++) {
+		const uint8_t* color = story->speakers[i].color;
+		palette[PaletteSpeakers + i] = glm::u8vec4(color[0], color[1], color[2], color[3]);
+	}
+	glGenTextures(1, &palette_tex);
+	glBindTexture(GL_TEXTURE_2D, palette_tex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, (GLsizei)palette.size(), 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, palette.data());
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 	glBindTexture(GL_TEXTURE_2D, 0);
 
-	for (const auto& file : std::filesystem::directory_iterator(data_path("assets/states"))) {
-		std::string name = file.path().filename().string();
-		State state;
-		std::ifstream ifile(data_path("assets/states/" + name), std::ios::binary);
-		read_chunk(ifile, "line", &state.lines);
-		read_chunk(ifile, "tran", &state.transitions);
-		read_chunk(ifile, "cond", &state.conditions);
-		read_chunk(ifile, "strn", &state.string_data);
-		state.name = name;
-		ifile.close();
-		states[name] = state;
-	}
-	current_state = "start";
+	// Transcript storage starts empty and grows as text is laid out
+	glGenBuffers(1, &transcript_buffer);
+	glGenVertexArrays(1, &transcript_buffer_for_tile_program);
 
-	timelines.emplace_back();
-	timelines.back().index = 0;
-	timelines.back().states.push_back(states[current_state]);
-	timelines.back().date = 2094;
-	current_timeline = 0;
+	// A resumed session is laid out all at once, from the states it visited, and shown the way it was left
+	timelines.resize(playthrough->timelines.size());
+	for (size_t i = 0; i < timelines.size(); i++) {
+		timelines[i].index = (int)i;
+	}
+	loadState(playthrough->current_state, shapers[mainSlot()]);
+	layoutTimelines();
+	validateTranscript();
+	if (resumed) {
+		scroll_x = view.scroll_x;
+		scroll_y = view.scroll_y;
+		observing_timeline = std::min(std::max(view.timeline, 0), (int)timelines.size() - 1);
+		scroll_to_timeline_end = false;
+	}
+	prefetchSuccessors(playthrough->current_state);
 }
 
 PlayMode::~PlayMode() {
+	saveSession();
+
+	// (stop the workers before the faces they use go away)
+	layout_pool.reset();
+	for (size_t i = 0; i < shapers.size(); i++) {
+		hb_buffer_destroy(shapers[i].hb_buffer);
+		if (i != mainSlot()) {
+			hb_font_destroy(shapers[i].hb_font);
+			FT_Done_Face(shapers[i].ft_face);
+		}
+	}
+	shapers.clear();
+	if (transcript_buffer_for_tile_program != 0) {
+		glDeleteVertexArrays(1, &transcript_buffer_for_tile_program);
+		transcript_buffer_for_tile_program = 0;
+	}
+	if (transcript_buffer != 0) {
+		glDeleteBuffers(1, &transcript_buffer);
+		transcript_buffer = 0;
+	}
+	if (palette_tex != 0) {
+		glDeleteTextures(1, &palette_tex);
+		palette_tex = 0;
+	}
+	glyph_atlas.reset();
+	if (ft_atlas_face) {
+		FT_Done_Face(ft_atlas_face);
+		ft_atlas_face = nullptr;
+	}
 }
 
-void PlayMode::useTrigger(std::string name) {
-	for (size_t i = 0; i < states[current_state].transitions.size(); i++) {
-		Transition& transition = states[current_state].transitions[i];
-		if (stateText(states[current_state], transition.trigger_start, transition.trigger_end) == name) {
-			// Found a transition for this trigger
-			
-			std::string new_state = stateText(states[current_state], states[current_state].conditions[transition.postconditions_start].name_start, states[current_state].conditions[transition.postconditions_start].name_end);
-			if (states.find(new_state) != states.end()) {
-				// Found the new state
-
-				int target_date = timelines[current_timeline].date;
-				bool new_timeline = false;
-				if (name == "Go to 2034") {
-					target_date = 2034;
-					new_timeline = true;
-				} else if (name == "15 YEARS AGO") {
-					target_date = 2019;
-					new_timeline = true;
-				}
+uint32_t PlayMode::internTrigger(const std::string& name) {
+	// (triggers are found during layout, which may be running on several threads)
+	std::lock_guard< std::mutex > lock(trigger_mutex);
+	auto found = trigger_ids.find(name);
+	if (found != trigger_ids.end()) {
+		return found->second;
+	}
+	uint32_t id = (uint32_t)trigger_names.size();
+	trigger_names.push_back(name);
+	trigger_ids.emplace(name, id);
+	return id;
+}
 
-				if (new_timeline) {
-					timelines.emplace_back();
-					timelines.back().date = target_date;
-					timelines.back().index = (int)timelines.size() - 1;
-					current_timeline = timelines.back().index;
-					observing_timeline = (int)current_timeline;
+const PlayMode::Trigger* PlayMode::findTrigger(glm::ivec2 position) const {
+	// Timelines are side by side, so the column picks the timeline...
+	if (position.x < 0 || position.x / timeline_width >= (int)timelines.size()) {
+		return nullptr;
+	}
+	const std::vector<Trigger>& candidates = timelines[position.x / timeline_width].triggers;
+
+	// ...and its triggers are ordered top to bottom, so the first one below the position can be found by binary search
+	auto it = std::partition_point(candidates.begin(), candidates.end(), [&](const Trigger& trigger) {
+		return trigger.position.y >= position.y;
+	});
+	// (only triggers on the same line can contain the position)
+	for (; it != candidates.end() && position.y < it->position.y + it->size.y; ++it) {
+		if (position.x > it->position.x && position.x < it->position.x + it->size.x) {
+			return &*it;
+		}
+	}
+	return nullptr;
+}
+
+void PlayMode::useTrigger(uint32_t trigger_id) {
+	size_t timeline_count = playthrough->timelines.size();
+	const Story::Edge* edge = playthrough->useTrigger(trigger_id);
+	if (!edge) {
+		return;
+	}
+	// (usually already loaded by prefetchSuccessors; if it is still loading, layout just shapes whatever isn't done)
+	loadState(edge->target, shapers[mainSlot()]);
+
+	bool new_timeline = (playthrough->timelines.size() != timeline_count);
+	if (new_timeline) {
+		timelines.emplace_back();
+		timelines.back().index = (int)timelines.size() - 1;
+	}
+
+	// Only the new text needs laying out, so it is done right here
+	Timeline& timeline = timelines[playthrough->current_timeline];
+	std::vector< LaidOutGlyph > glyphs;
+	size_t first_line = timeline.line_instances.size();
+	if (new_timeline) {
+		layoutTimelineHeader(timeline, shapers[mainSlot()], &glyphs);
+	}
+	layoutState(timeline, playthrough->timelines[timeline.index].state_ids.size() - 1, shapers[mainSlot()], &glyphs);
+	commitLayout(timeline, first_line, glyphs);
+	validateTranscript();
+	scroll_to_timeline_end = true;
+	observing_timeline = (int)playthrough->current_timeline;
+	prefetchSuccessors(playthrough->current_state);
+	saveSession();
+}
+
+void PlayMode::saveSession() {
+	Playthrough::View view;
+	view.scroll_x = scroll_x;
+	view.scroll_y = scroll_y;
+	view.timeline = observing_timeline;
+	try {
+		playthrough->save(session_path, view);
+	} catch (std::exception& e) {
+		std::cerr << "WARNING: couldn't save the session: " << e.what() << std::endl;
+	}
+}
+
+void PlayMode::loadState(uint32_t state_id, Shaper& shaper) {
+	uint8_t expected = StateUnloaded;
+	if (!state_status[state_id].compare_exchange_strong(expected, StateLoading)) {
+		return;
+	}
+
+	// Shaping reads the state's text (paging it in from the bundle) and leaves the result in the shaped text cache for layout
+	const Story::State& state = story->states[state_id];
+	for (size_t i = 0; i < state.lines.size(); i++) {
+		shapeLine(state, i, story->lineText(state, i), state_width, shaper);
+	}
+
+	state_status[state_id] = StateLoaded;
+}
+
+void PlayMode::prefetchSuccessors(uint32_t state_id) {
+	// Breadth-first over transitions, up to prefetch_depth away
+	std::vector<uint32_t> frontier = { state_id };
+	std::vector<bool> visited(story->states.size(), false);
+	visited[state_id] = true;
+	for (int depth = 0; depth < prefetch_depth && !frontier.empty(); depth++) {
+		std::vector<uint32_t> next;
+		for (uint32_t from : frontier) {
+			for (const Story::Edge& edge : story->states[from].edges) {
+				if (visited[edge.target]) {
+					continue;
+				}
+				visited[edge.target] = true;
+				next.push_back(edge.target);
+				if (state_status[edge.target] == StateUnloaded) {
+					uint32_t target = edge.target;
+					layout_pool->submit([this, target](size_t slot) {
+						loadState(target, shapers[slot]);
+					});
 				}
-				
-				timelines[current_timeline].states.push_back(states[new_state]);
-				scroll_to_timeline_end = true;
-				current_state = new_state;
-				observing_timeline = (int)current_timeline;
 			}
 		}
+		frontier = std::move(next);
 	}
 }
 
@@ -213,11 +419,9 @@ bool PlayMode::handle_event(SDL_Event const& evt, glm::uvec2 const& window_size)
 		y = ScreenHeight - y;
 		y += scroll_y;
 		x += scroll_x;
-		for (size_t i = 0; i < triggers.size(); i++) {
-			Trigger& trigger = triggers[i];
-			if (x > trigger.position.x && x < trigger.position.x + trigger.size.x && y > trigger.position.y && y < trigger.position.y + trigger.size.y) {
-				useTrigger(trigger.name);
-			}
+		const Trigger* trigger = findTrigger(glm::ivec2(x, y));
+		if (trigger) {
+			useTrigger(trigger->id);
 		}
 		return true;
 	} else if (evt.type == SDL_MOUSEWHEEL) {
@@ -235,184 +439,402 @@ void PlayMode::update(float elapsed) {
 	down.downs = 0;
 }
 
-int PlayMode::drawText(std::string text, glm::vec2 position, size_t width, std::vector<PPUDataStream::Vertex>* triangle_strip, glm::u8vec4 color) {
-	//helper to put a single tile somewhere on the screen:
-	auto draw_tile = [&](glm::ivec2 const& lower_left, uint8_t tile_index, glm::u8vec4 tile_color) {
-		float font_multiplier = (float)font_size / char_height;
+const PlayMode::ShapedText& PlayMode::shapeText(const std::string& text, size_t width, Shaper& shaper) {
+	ShapedTextKey key;
+	key.text = text;
+	key.font = hb_font;
+	key.size = font_size;
+	key.width = width;
+
+	{
+		std::lock_guard< std::mutex > lock(shaped_text_mutex);
+		auto found = shaped_text_cache.find(key);
+		if (found != shaped_text_cache.end()) {
+			return found->second;
+		}
+	}
 
-		//convert tile index to lower-left pixel coordinate in tile image:
-		glm::ivec2 tile_coord = glm::ivec2(tile_index * char_width, 0);
+	// Shaping happens outside the lock (if two threads shape the same text, the first result is kept)
+	ShapedText shaped;
+
+	// Each shaper's Harfbuzz buffer is reused for all of its shaping
+	hb_buffer_t* hb_buffer = shaper.hb_buffer;
+
+	// Shape the whole paragraph once
+	hb_buffer_clear_contents(hb_buffer);
+	hb_buffer_add_utf8(hb_buffer, text.c_str(), (int)text.size(), 0, (int)text.size());
+	hb_buffer_guess_segment_properties(hb_buffer);
+	hb_shape(shaper.hb_font, hb_buffer, NULL, 0);
+
+	unsigned int len = hb_buffer_get_length(hb_buffer);
+	hb_glyph_info_t* info = hb_buffer_get_glyph_infos(hb_buffer, NULL);
+	hb_glyph_position_t* pos = hb_buffer_get_glyph_positions(hb_buffer, NULL);
+
+	shaped.glyphs.reserve(len);
+	for (size_t i = 0; i < len; i++) {
+		ShapedGlyph glyph;
+		glyph.glyph = info[i].codepoint;
+		glyph.cluster = info[i].cluster;
+		glyph.advance = glm::ivec2(pos[i].x_advance, pos[i].y_advance);
+		glyph.offset = glm::ivec2(pos[i].x_offset, pos[i].y_offset);
+		shaped.glyphs.push_back(glyph);
+	}
 
-		//build a quad as a (very short) triangle strip that starts and ends with degenerate triangles:
-		triangle_strip->emplace_back(glm::ivec2(lower_left.x + 0, lower_left.y - (int)(char_bottom * font_multiplier)), glm::ivec2(tile_coord.x + 0, tile_coord.y + 0), tile_color);
-		triangle_strip->emplace_back(triangle_strip->back());
-		triangle_strip->emplace_back(glm::ivec2(lower_left.x + 0, lower_left.y + (int)(char_top * font_multiplier)), glm::ivec2(tile_coord.x + 0, tile_coord.y + char_height), tile_color);
-		triangle_strip->emplace_back(glm::ivec2(lower_left.x + (int)(char_width * font_multiplier), lower_left.y - (int)(char_bottom * font_multiplier)), glm::ivec2(tile_coord.x + char_width, tile_coord.y + 0), tile_color);
-		triangle_strip->emplace_back(glm::ivec2(lower_left.x + (int)(char_width * font_multiplier), lower_left.y + (int)(char_top * font_multiplier)), glm::ivec2(tile_coord.x + char_width, tile_coord.y + char_height), tile_color);
-		triangle_strip->emplace_back(triangle_strip->back());
-	};
+	breakLines(text, width, &shaped);
+	return cacheShapedText(std::move(key), std::move(shaped));
+}
 
-	const char* text_c_str = text.c_str();
-	size_t start_line = 0;
-	size_t line_num = 0;
+const PlayMode::ShapedText& PlayMode::shapeLine(const Story::State& state, size_t line_num, const std::string& text, size_t width, Shaper& shaper) {
+	if (!baked_text) {
+		return shapeText(text, width, shaper);
+	}
 
-	while (start_line < text.size()) {
-		line_num++;
+	// Baked glyphs are the same as what shapeText would get from Harfbuzz, so they share its cache
+	ShapedTextKey key;
+	key.text = text;
+	key.font = hb_font;
+	key.size = font_size;
+	key.width = width;
+
+	{
+		std::lock_guard< std::mutex > lock(shaped_text_mutex);
+		auto found = shaped_text_cache.find(key);
+		if (found != shaped_text_cache.end()) {
+			return found->second;
+		}
+	}
+
+	// (text came from lineText, which checked that the baked clusters index into it)
+	ShapedText shaped;
+	const Story::Line& line = state.lines[line_num];
+	shaped.glyphs.reserve(line.glyphs_end - line.glyphs_start);
+	for (const Story::Glyph& baked : story->glyphs.slice(line.glyphs_start, line.glyphs_end)) {
+		ShapedGlyph glyph;
+		glyph.glyph = baked.glyph;
+		glyph.cluster = baked.cluster;
+		glyph.advance = glm::ivec2(baked.x_advance, baked.y_advance);
+		glyph.offset = glm::ivec2(baked.x_offset, baked.y_offset);
+		shaped.glyphs.push_back(glyph);
+	}
+
+	breakLines(text, width, &shaped);
+	return cacheShapedText(std::move(key), std::move(shaped));
+}
+
+const PlayMode::ShapedText& PlayMode::cacheShapedText(ShapedTextKey&& key, ShapedText&& shaped) {
+	std::lock_guard< std::mutex > lock(shaped_text_mutex);
+	return shaped_text_cache.emplace(std::move(key), std::move(shaped)).first->second;
+}
+
+void PlayMode::breakLines(const std::string& text, size_t width, ShapedText* shaped) {
+	size_t len = shaped->glyphs.size();
+	if (len == 0) {
+		return;
+	}
+
+	// Greedy line breaking, in one pass over the glyphs.
+	// Lines may break after a space (but never inside a bracketed trigger), as late as the width allows;
+	// if a line has nowhere to break, it breaks after the glyph that overflows.
+	// Breaks only ever happen between glyphs, so clusters (e.g. ligatures) stay whole.
+	const double limit = (double)width - char_width;
+	shaped->line_starts.push_back(0);
+	double current_x = 0.0; // pen position after the last glyph on the line
+	size_t break_after = len; // last glyph it is possible to break after on this line (len if none)
+	double break_x = 0.0; // pen position after that glyph
+	bool in_trigger = false;
+	for (size_t i = 0; i < len; i++) {
+		char c = text[shaped->glyphs[i].cluster];
+		if (c == '[') {
+			in_trigger = true;
+		}
+		if (in_trigger && c == ']') {
+			in_trigger = false;
+		}
+
+		bool breakable = (!in_trigger && c == ' ');
+
+		current_x += shaped->glyphs[i].advance.x / 64.;
 
-		// Create hb-buffer and populate.
-		hb_buffer_t* hb_buffer;
-		hb_buffer = hb_buffer_create();
-		hb_buffer_add_utf8(hb_buffer, text_c_str + start_line, -1, 0, -1);
-		hb_buffer_guess_segment_properties(hb_buffer);
+		if (current_x > limit && i + 1 < len) {
+			// Break at the last opportunity, moving the rest of the word to the next line, or else right here
+			// (a space that overflows just hangs off the end of the line)
+			size_t next_start = i + 1;
+			if (!breakable && break_after != len) {
+				next_start = break_after + 1;
+				current_x -= break_x;
+			} else {
+				current_x = 0.0;
+			}
+			shaped->line_starts.push_back(next_start);
+			break_after = len;
+			continue;
+		}
 
-		// Shape it!
-		hb_feature_t feature;
-		hb_feature_from_string("-liga", -1, &feature);
-		hb_shape(hb_font, hb_buffer, &feature, 1);
+		if (breakable) {
+			break_after = i;
+			break_x = current_x;
+		}
+	}
+}
 
-		// Get glyph information and positions out of the buffer.
-		unsigned int len = hb_buffer_get_length(hb_buffer);
-		hb_glyph_position_t* pos = hb_buffer_get_glyph_positions(hb_buffer, NULL);
+int PlayMode::drawText(std::string text, glm::vec2 position, size_t width, Shaper& shaper, std::vector<LaidOutGlyph>* glyphs, uint8_t palette, std::vector<Trigger>* triggers) {
+	return drawShapedText(text, shapeText(text, width, shaper), position, glyphs, palette, triggers);
+}
+
+int PlayMode::drawShapedText(const std::string& text, const ShapedText& shaped, glm::vec2 position, std::vector<LaidOutGlyph>* glyphs, uint8_t palette, std::vector<Trigger>* triggers) {
+	size_t line_num = 0;
+
+	for (size_t l = 0; l < shaped.line_starts.size(); l++) {
+		line_num++;
+		size_t line_end = (l + 1 < shaped.line_starts.size() ? shaped.line_starts[l + 1] : shaped.glyphs.size());
 
 		// Draw text
 		double current_x = position.x;
 		double current_y = position.y - line_num * font_size;
 		bool in_trigger = false;
 		Trigger trigger;
-		for (size_t i = 0; i < len; i++)
-		{
+		size_t trigger_start = 0;
+		for (size_t i = shaped.line_starts[l]; i < line_end; i++) {
+			const ShapedGlyph& glyph = shaped.glyphs[i];
+			char c = text[glyph.cluster];
+
 			// Populate trigger struct for bracketed text
-			if (text[start_line + i] == '[') {
+			if (c == '[') {
 				in_trigger = true;
-				trigger.name = "";
+				trigger_start = glyph.cluster + 1;
 				trigger.position = glm::vec2(current_x, current_y);
 			}
-			if (in_trigger && text[start_line + i] != '[' && text[start_line + i] != ']') {
-				trigger.name = trigger.name + text[start_line + i];
-			}
-			if (in_trigger && text[start_line + i] == ']') {
+			if (in_trigger && c == ']') {
 				in_trigger = false;
 				trigger.size = glm::vec2(current_x - trigger.position.x, font_size);
-				triggers.push_back(trigger);
-			}
-
-			// Line break if next word would overflow
-			if (!in_trigger && text[start_line + i] == ' ') {
-				double cx = current_x + pos[i].x_advance / 64.;
-				bool line_break = false;
-				bool trigger_word = false;
-				for (size_t j = i + 1; j < len; j++) {
-					if (text[start_line + j] == '[') {
-						trigger_word = true;
-					}
-					if (text[start_line + j] == ']') {
-						trigger_word = false;
-					}
-					if (text[start_line + j] == ' ' && !trigger_word) {
-						break;
-					}
-					cx += pos[j].x_advance / 64.;
-					if (cx + char_width > position.x + width) {
-						line_break = true;
-						break;
-					}
-				}
-				if (line_break) {
-					start_line = start_line + i + 1;
-					break;
+				if (triggers) {
+					trigger.id = internTrigger(text.substr(trigger_start, glyph.cluster - trigger_start));
+					triggers->push_back(trigger);
 				}
 			}
 
 			// Draw character
-			glm::u8vec4 tile_color = color;
-			if (in_trigger || text[start_line + i] == ']') {
-				tile_color = trigger_color;
+			uint8_t glyph_palette = palette;
+			if (in_trigger || c == ']') {
+				glyph_palette = PaletteTrigger;
 			}
-			draw_tile(glm::ivec2((int)(current_x + pos[i].x_offset / 64.), (int)(current_y + pos[i].y_offset / 64.)), (uint8_t)text[start_line + i] - (uint8_t)min_char, tile_color);
-			
+			LaidOutGlyph laid_out;
+			laid_out.pen = glm::ivec2((int)(current_x + glyph.offset.x / 64.), (int)(current_y + glyph.offset.y / 64.));
+			laid_out.glyph = glyph.glyph;
+			laid_out.palette = glyph_palette;
+			glyphs->push_back(laid_out);
+
 			// Advance position
-			current_x += pos[i].x_advance / 64.;
-			current_y += pos[i].y_advance / 64.;
-			
-			// Line break on overflow (may be necessary if there are no spaces)
-			if (current_x + char_width > position.x + width || i == len - 1) {
-				start_line = start_line + i + 1;
-				break;
-			}
-			
+			current_x += glyph.advance.x / 64.;
+			current_y += glyph.advance.y / 64.;
 		}
 	}
 	
 	return (int)(line_num * font_size);
 
-	// TODO: start doing size estimation again?
-	//assert(triangle_strip.size() == TristripSize && "Triangle strip size was estimated exactly.");
 }
 
-std::string PlayMode::stateText(const State& state, size_t start, size_t end) {
-	return std::string(state.string_data.begin() + start, state.string_data.begin() + end);
+void PlayMode::resolveGlyphs(const LaidOutGlyph* begin, const LaidOutGlyph* end, std::vector<PPUDataStream::GlyphInstance>* instances) {
+	for (const LaidOutGlyph* laid_out = begin; laid_out != end; laid_out++) {
+		GlyphAtlas::Glyph glyph = glyph_atlas->get(laid_out->glyph);
+		if (glyph.size.x == 0 || glyph.size.y == 0) {
+			continue;
+		}
+
+		//the quad itself is sized by the vertex shader, from the atlas rect table and GLYPH_SCALE:
+		glm::ivec2 lower_left = laid_out->pen + glm::ivec2((int)(glyph.bearing.x * glyph_scale), (int)(glyph.bearing.y * glyph_scale));
+		instances->emplace_back(lower_left, glyph.rect, laid_out->palette);
+	}
+}
+
+int PlayMode::drawLine(const Story::State& state, size_t line_num, glm::ivec2 position, Shaper& shaper, std::vector<LaidOutGlyph>* glyphs, std::vector<Trigger>* triggers) {
+	// Spoken lines are drawn in their speaker's color
+	const Story::Line& line = state.lines[line_num];
+	uint8_t palette = (line.spoken ? uint8_t(PaletteSpeakers + line.speaker) : uint8_t(PaletteDefault));
+
+	// Draw the line, leaving space before the next line
+	std::string text = story->lineText(state, line_num);
+	return drawShapedText(text, shapeLine(state, line_num, text, state_width, shaper), position, glyphs, palette, triggers) + font_size;
 }
 
-std::string PlayMode::lineText(const State& state, size_t line_num) {
-	Line line = state.lines[line_num];
-	std::string ret = "";
-	if (line.spoken) {
-		ret = stateText(state, line.speaker_start, line.speaker_end) + ": ";
+void PlayMode::appendTranscript(const std::vector<PPUDataStream::GlyphInstance>& instances) {
+	if (instances.empty()) {
+		return;
+	}
+
+	// Grow the transcript buffer (copying the old contents over) if the new text doesn't fit
+	if (transcript_size + instances.size() > transcript_capacity) {
+		size_t new_capacity = std::max< size_t >(transcript_capacity * 2, 1 << 14);
+		while (new_capacity < transcript_size + instances.size()) {
+			new_capacity *= 2;
+		}
+
+		GLuint new_buffer = 0;
+		glGenBuffers(1, &new_buffer);
+		glBindBuffer(GL_COPY_WRITE_BUFFER, new_buffer);
+		glBufferData(GL_COPY_WRITE_BUFFER, new_capacity * sizeof(PPUDataStream::GlyphInstance), NULL, GL_STATIC_DRAW);
+		if (transcript_size > 0) {
+			glBindBuffer(GL_COPY_READ_BUFFER, transcript_buffer);
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, transcript_size * sizeof(PPUDataStream::GlyphInstance));
+			glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		}
+		glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+		glDeleteBuffers(1, &transcript_buffer);
+		transcript_buffer = new_buffer;
+		transcript_capacity = new_capacity;
+
+		glBindVertexArray(transcript_buffer_for_tile_program);
+		bind_tile_attributes(data_stream->quad_buffer, transcript_buffer);
+		glBindVertexArray(0);
+	}
+
+	// Upload only the new text
+	glBindBuffer(GL_ARRAY_BUFFER, transcript_buffer);
+	glBufferSubData(GL_ARRAY_BUFFER, transcript_size * sizeof(PPUDataStream::GlyphInstance), instances.size() * sizeof(PPUDataStream::GlyphInstance), instances.data());
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	transcript_size += instances.size();
+
+	GL_ERRORS();
+}
+
+void PlayMode::validateTranscript() {
+	// If glyphs were evicted from the atlas, transcript vertices point at stale atlas positions and must be rebuilt
+	// (two attempts, in case the whole transcript doesn't fit in the atlas at once)
+	for (int attempt = 0; attempt < 2 && transcript_atlas_generation != glyph_atlas->generation; attempt++) {
+		transcript_atlas_generation = glyph_atlas->generation;
+		layoutTimelines();
 	}
-	return ret + stateText(state, line.text_start, line.text_end);
 }
 
-int PlayMode::drawState(const State& state, glm::ivec2 position, std::vector<PPUDataStream::Vertex>* triangle_strip) {
-	int y = position.y;
-	for (size_t i = 0; i < state.lines.size(); i ++) {
-		// Set character-specific colors
-		glm::u8vec4 color = default_color;
-		std::string speaker = stateText(state, state.lines[i].speaker_start, state.lines[i].speaker_end);
-		if (speaker == "Angela" || speaker == "Child") {
-			color = angela_color;
-		} else if (speaker == "You") {
-			color = you_color;
-		} else if (speaker == "Z") {
-			color = z_color;
+void PlayMode::layoutTimelines() {
+	// Timelines are laid out independently (one job each), but added to the transcript in order, on the main thread
+	std::vector< std::vector< LaidOutGlyph > > glyphs(timelines.size());
+	layout_pool->parallel_for(timelines.size(), [&](size_t i, size_t slot) {
+		Timeline& timeline = timelines[i];
+		layoutTimelineHeader(timeline, shapers[slot], &glyphs[i]);
+		for (size_t s = 0; s < playthrough->timelines[i].state_ids.size(); s++) {
+			layoutState(timeline, s, shapers[slot], &glyphs[i]);
 		}
+	});
+
+	transcript_size = 0;
+	for (size_t i = 0; i < timelines.size(); i++) {
+		commitLayout(timelines[i], 0, glyphs[i]);
+	}
+}
+
+void PlayMode::commitLayout(Timeline& timeline, size_t first_line, const std::vector<LaidOutGlyph>& glyphs) {
+	// Until now, line ranges index into glyphs; glyphs that take no space in the atlas are dropped here, so the ranges shrink
+	std::vector< PPUDataStream::GlyphInstance > instances;
+	instances.reserve(glyphs.size());
+	for (size_t i = first_line; i < timeline.line_instances.size(); i++) {
+		InstanceRange& line = timeline.line_instances[i];
+		size_t first = instances.size();
+		resolveGlyphs(glyphs.data() + line.first, glyphs.data() + line.first + line.count, &instances);
+		line.first = transcript_size + first;
+		line.count = instances.size() - first;
+	}
 
-		// Draw the line
-		y -= drawText(lineText(state, i), glm::vec2(position.x, y), state_width, triangle_strip, color);
+	appendTranscript(instances);
+}
 
-		// Move down to create space for the next line
-		y -= font_size;
+void PlayMode::addLayoutLine(Timeline& timeline, int height, size_t first_instance, size_t instance_count) {
+	if (timeline.line_tops.empty()) {
+		timeline.line_tops.push_back(0);
 	}
-	return position.y - y;
+	timeline.line_tops.push_back(timeline.line_tops.back() + height);
+	timeline.line_instances.push_back(InstanceRange{ first_instance, instance_count });
 }
 
-void PlayMode::drawTimeline(const Timeline& timeline, std::vector<PPUDataStream::Vertex>* triangle_strip) {
+void PlayMode::layoutTimelineHeader(Timeline& timeline, Shaper& shaper, std::vector<LaidOutGlyph>* glyphs) {
 	int x = timeline.index * timeline_width;
 	int y = ScreenHeight;
 
-	drawText("Year " + std::to_string(timeline.date), glm::vec2(x, y), timeline_width, triangle_strip, date_color);
-	y -= font_size * 2;
+	// The header is always the first line of the timeline
+	timeline.line_tops.clear();
+	timeline.line_instances.clear();
+	timeline.triggers.clear();
 
-	for (size_t i = 0; i < timeline.states.size(); i++) {
-		if (scroll_to_timeline_end && timeline.index == observing_timeline && (i == 0 || observing_timeline == (int)current_timeline)) {
-			scroll_x = x - (ScreenWidth - timeline_width) / 2;
-			scroll_y = y - ScreenHeight;
-			if (i == 0) {
-				scroll_y += font_size * 2;
-			}
+	size_t first = glyphs->size();
+	drawText("Year " + std::to_string(playthrough->timelines[timeline.index].date), glm::vec2(x, y), timeline_width, shaper, glyphs, PaletteDate);
+	addLayoutLine(timeline, font_size * 2, first, glyphs->size() - first);
+	timeline.layout_y = y - font_size * 2;
+}
+
+void PlayMode::layoutState(Timeline& timeline, size_t state_index, Shaper& shaper, std::vector<LaidOutGlyph>* glyphs) {
+	int x = timeline.index * timeline_width;
+	int y = timeline.layout_y;
+
+	const std::vector<uint32_t>& state_ids = playthrough->timelines[timeline.index].state_ids;
+	timeline.state_tops.resize(state_ids.size());
+	timeline.state_tops[state_index] = y;
+
+	const Story::State& state = story->states[state_ids[state_index]];
+	for (size_t i = 0; i < state.lines.size(); i++) {
+		size_t first = glyphs->size();
+		int height = drawLine(state, i, glm::ivec2(x, y), shaper, glyphs, &timeline.triggers);
+		// (the space after the state belongs to its last line)
+		if (i + 1 == state.lines.size()) {
+			height += font_size;
 		}
+		addLayoutLine(timeline, height, first, glyphs->size() - first);
+		y -= height;
+	}
+	timeline.layout_y = y;
+}
 
-		y -= drawState(timeline.states[i], glm::vec2(x, y), triangle_strip);
-		y -= font_size;
+void PlayMode::drawGlyphs(const std::vector<PPUDataStream::GlyphInstance>& instances) {
+	if (instances.empty()) {
+		return;
 	}
 
-	drawText(std::to_string(timeline.index), glm::vec2(x - timeline_width * 0.05, scroll_y + (int)ScreenHeight), timeline_width, triangle_strip, timeline_index_color);
+	// Upload instances to the shared stream buffer
+	StreamBuffer& stream = StreamBuffer::shared();
+	GLintptr offset = stream.upload(instances.data(), sizeof(instances[0]) * instances.size(), sizeof(instances[0]));
+
+	drawTiles(data_stream->vertex_buffer_for_tile_program, stream.buffer, { InstanceRange{ offset / sizeof(instances[0]), instances.size() } });
 }
 
-void PlayMode::drawTriangleStrip(const std::vector<PPUDataStream::Vertex>& triangle_strip) {
-	// Upload vertex buffer
-	glBindBuffer(GL_ARRAY_BUFFER, data_stream->vertex_buffer);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(decltype(triangle_strip[0])) * triangle_strip.size(), triangle_strip.data(), GL_STREAM_DRAW);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+std::vector< PlayMode::InstanceRange > PlayMode::visibleTranscript(int margin) const {
+	std::vector< InstanceRange > ranges;
+
+	// Lines are found by their distance below the top of the timeline, which is what line_tops stores
+	int view_top = ScreenHeight - (scroll_y + (int)ScreenHeight) - margin;
+	int view_bottom = ScreenHeight - scroll_y + margin;
+
+	for (const Timeline& timeline : timelines) {
+		int x = timeline.index * timeline_width;
+		if (x + timeline_width < scroll_x - margin || x > scroll_x + (int)ScreenWidth + margin) {
+			continue;
+		}
+		if (timeline.line_instances.empty()) {
+			continue;
+		}
+
+		// First line that ends below the top of the view, up to the first line that starts below the bottom of it
+		auto begin = std::upper_bound(timeline.line_tops.begin() + 1, timeline.line_tops.end(), view_top);
+		auto end = std::lower_bound(timeline.line_tops.begin(), timeline.line_tops.end() - 1, view_bottom);
+		size_t first_line = begin - (timeline.line_tops.begin() + 1);
+		size_t end_line = end - timeline.line_tops.begin();
+
+		for (size_t i = first_line; i < end_line; i++) {
+			const InstanceRange& line = timeline.line_instances[i];
+			// Lines laid out together are adjacent in the transcript buffer, so they can be drawn together
+			if (!ranges.empty() && ranges.back().first + ranges.back().count == line.first) {
+				ranges.back().count += line.count;
+			} else if (line.count > 0) {
+				ranges.push_back(line);
+			}
+		}
+	}
+
+	return ranges;
+}
+
+void PlayMode::drawTiles(GLuint vertex_array, GLuint instance_buffer, const std::vector< InstanceRange >& ranges) {
+	if (ranges.empty()) {
+		return;
+	}
 
 	//set up the pipeline:
 	// set blending function for output fragments:
@@ -420,11 +842,12 @@ void PlayMode::drawTriangleStrip(const std::vector<PPUDataStream::Vertex>& trian
 	glBlendEquation(GL_FUNC_ADD);
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-	// set the shader programs:
-	glUseProgram(tile_program->program);
+	// set the shader programs (the distance field variant needs a distance field atlas):
+	const PPUTileProgram& program = (glyph_atlas->mode == GlyphAtlas::SDF ? *sdf_tile_program : *tile_program);
+	glUseProgram(program.program);
 
 	// configure attribute streams:
-	glBindVertexArray(data_stream->vertex_buffer_for_tile_program);
+	glBindVertexArray(vertex_array);
 
 	// set uniforms for shader programs:
 	{ //set matrix to transform [0,ScreenWidth]x[0,ScreenHeight] -> [-1,1]x[-1,1]:
@@ -435,15 +858,28 @@ void PlayMode::drawTriangleStrip(const std::vector<PPUDataStream::Vertex>& trian
 			glm::vec4(0.0f, 0.0f, 1.0f, 0.0f),
 			glm::vec4(-1.0f - scroll_x * 2.f / ScreenWidth, -1.0f - scroll_y * 2.f / ScreenHeight, 0.0f, 1.0f)
 		);
-		glUniformMatrix4fv(tile_program->OBJECT_TO_CLIP_mat4, 1, GL_FALSE, glm::value_ptr(OBJECT_TO_CLIP));
+		glUniformMatrix4fv(program.OBJECT_TO_CLIP_mat4, 1, GL_FALSE, glm::value_ptr(OBJECT_TO_CLIP));
 	}
+	glUniform1f(program.GLYPH_SCALE_float, glyph_scale);
 
 	// bind texture units to proper texture objects:
 	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, data_stream->tile_tex);
-
-	//now that the pipeline is configured, trigger drawing of triangle strip:
-	glDrawArrays(GL_TRIANGLE_STRIP, 0, GLsizei(triangle_strip.size()));
+	glBindTexture(GL_TEXTURE_2D, glyph_atlas->tex);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, palette_tex);
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_2D, glyph_atlas->rect_tex);
+
+	//now that the pipeline is configured, draw the unit quad once per glyph in each range:
+	for (const InstanceRange& range : ranges) {
+		if (range.count == 0) {
+			continue;
+		}
+		if (instance_buffer != 0) {
+			bind_tile_attributes(data_stream->quad_buffer, instance_buffer, range.first);
+		}
+		glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, GLsizei(range.count));
+	}
 
 	GL_ERRORS();
 }
@@ -485,20 +921,45 @@ void PlayMode::draw(glm::uvec2 const& drawable_size) {
 		glViewport(lower_left.x, lower_left.y, scale * ScreenWidth, scale * ScreenHeight);
 	}
 
-	std::vector< PPUDataStream::Vertex > triangle_strip;
-
-	triggers.clear();
+	// Jump to the end of the observed timeline (or the start, if it isn't the current one)
+	if (scroll_to_timeline_end && observing_timeline < (int)timelines.size()) {
+		const Timeline& timeline = timelines[observing_timeline];
+		size_t i = (observing_timeline == (int)playthrough->current_timeline ? timeline.state_tops.size() - 1 : 0);
+		scroll_x = timeline.index * timeline_width - (ScreenWidth - timeline_width) / 2;
+		scroll_y = timeline.state_tops[i] - ScreenHeight;
+		if (i == 0) {
+			scroll_y += font_size * 2;
+		}
+	}
+	scroll_to_timeline_end = false;
 
-	//drawState(states[current_state], glm::ivec2(0, ScreenHeight), &triangle_strip);
+	// Timeline numbers follow the scroll position, so they are streamed every frame
+	// (rebuilt if drawing them evicted glyphs from the atlas)
+	std::vector< LaidOutGlyph > glyphs;
 	for (size_t i = 0; i < timelines.size(); i ++) {
-		drawTimeline(timelines[i], &triangle_strip);
+		int x = timelines[i].index * timeline_width;
+		drawText(std::to_string(timelines[i].index), glm::vec2(x - timeline_width * 0.05, scroll_y + (int)ScreenHeight), timeline_width, shapers[mainSlot()], &glyphs, PaletteTimelineIndex);
+	}
+	std::vector< PPUDataStream::GlyphInstance > instances;
+	for (int attempt = 0; attempt < 2; attempt++) {
+		uint32_t generation = glyph_atlas->generation;
+		instances.clear();
+		resolveGlyphs(glyphs.data(), glyphs.data() + glyphs.size(), &instances);
+		validateTranscript();
+		if (generation == glyph_atlas->generation) {
+			break;
+		}
 	}
 
-	scroll_to_timeline_end = false;
-
-	drawTriangleStrip(triangle_strip);
+	// All transcript text is already in the transcript buffer, but only lines near the view are drawn
+	drawTiles(transcript_buffer_for_tile_program, transcript_buffer, visibleTranscript(font_size * 2));
+	drawGlyphs(instances);
 
 	//return state to default:
+	glActiveTexture(GL_TEXTURE2);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE1);
+	glBindTexture(GL_TEXTURE_2D, 0);
 	glActiveTexture(GL_TEXTURE0);
 	glBindTexture(GL_TEXTURE_2D, 0);
 	glBindVertexArray(0);
@@ -513,52 +974,81 @@ void PlayMode::draw(glm::uvec2 const& drawable_size) {
 
 // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-PlayMode::PPUTileProgram::PPUTileProgram() {
+PlayMode::PPUTileProgram::PPUTileProgram(Variant variant) {
+	//fragment shaders for each variant:
+	const char* fragment_shader = nullptr;
+	if (variant == Coverage) {
+		//alpha comes straight from the atlas:
+		fragment_shader =
+			"#version 330\n"
+			"uniform sampler2D TILE_TABLE;\n"
+			"in vec2 tileCoord;\n"
+			"out vec4 fragColor;\n"
+			"in vec4 color;\n"
+			"void main() {\n"
+			"	fragColor = vec4(color.rgb, texelFetch(TILE_TABLE, ivec2(tileCoord), 0).r);\n"
+			"}\n";
+	} else {
+		//alpha is an antialiased threshold of the (interpolated) distance, about one pixel wide at any scale:
+		fragment_shader =
+			"#version 330\n"
+			"uniform sampler2D TILE_TABLE;\n"
+			"in vec2 tileCoord;\n"
+			"out vec4 fragColor;\n"
+			"in vec4 color;\n"
+			"void main() {\n"
+			"	float dist = texture(TILE_TABLE, tileCoord / vec2(textureSize(TILE_TABLE, 0))).r - 0.5;\n"
+			"	float w = max(fwidth(dist), 1e-4) * 0.5;\n"
+			"	fragColor = vec4(color.rgb, smoothstep(-w, w, dist));\n"
+			"}\n";
+	}
+
 	program = gl_compile_program(
 		//vertex shader:
+		// (attribute locations are fixed so both variants work with the same vertex array objects)
 		"#version 330\n"
 		"uniform mat4 OBJECT_TO_CLIP;\n"
-		"in vec4 Position;\n"
-		"in ivec2 TileCoord;\n"
+		"uniform float GLYPH_SCALE;\n"
+		"uniform sampler2D PALETTE_TABLE;\n"
+		"uniform usampler2D RECT_TABLE;\n"
+		"layout(location = 0) in vec2 Corner;\n"
+		"layout(location = 1) in ivec2 Position;\n"
+		"layout(location = 2) in uint Rect;\n"
+		"layout(location = 3) in uint Palette;\n"
 		"out vec2 tileCoord;\n"
-		"in vec4 Color;\n"
 		"out vec4 color;\n"
 		"void main() {\n"
-		"	gl_Position = OBJECT_TO_CLIP * Position;\n"
-		"	tileCoord = TileCoord;\n"
-		"	color = Color;\n"
+		"	uvec4 rect = texelFetch(RECT_TABLE, ivec2(int(Rect % 256u), int(Rect / 256u)), 0);\n"
+		"	vec2 size = vec2(rect.zw);\n"
+		"	gl_Position = OBJECT_TO_CLIP * vec4(vec2(Position) + Corner * size * GLYPH_SCALE, 0.0, 1.0);\n"
+		"	tileCoord = vec2(rect.xy) + Corner * size;\n"
+		"	color = texelFetch(PALETTE_TABLE, ivec2(int(Palette), 0), 0);\n"
 		"}\n"
 		,
 		//fragment shader:
-		"#version 330\n"
-		"uniform sampler2D TILE_TABLE;\n"
-		"in vec2 tileCoord;\n"
-		"out vec4 fragColor;\n"
-		"in vec4 color;\n"
-		"void main() {\n"
-		"fragColor = texelFetch(TILE_TABLE, ivec2(tileCoord), 0);\n"
-		"fragColor.r = color.r;\n"
-		"fragColor.g = color.g;\n"
-		"fragColor.b = color.b;\n"
-		"}\n"
+		fragment_shader
 	);
+	static_assert(GlyphAtlas::RectTableWidth == 256, "vertex shader assumes 256-wide rect table");
 
 	//look up the locations of vertex attributes:
-	Position_vec2 = glGetAttribLocation(program, "Position");
-	TileCoord_ivec2 = glGetAttribLocation(program, "TileCoord");
-	Color_vec4 = glGetAttribLocation(program, "Color");
-	//Palette_int = glGetAttribLocation(program, "Palette");
+	Corner_vec2 = glGetAttribLocation(program, "Corner");
+	Position_ivec2 = glGetAttribLocation(program, "Position");
+	Rect_uint = glGetAttribLocation(program, "Rect");
+	Palette_uint = glGetAttribLocation(program, "Palette");
 
 	//look up the locations of uniforms:
 	OBJECT_TO_CLIP_mat4 = glGetUniformLocation(program, "OBJECT_TO_CLIP");
+	GLYPH_SCALE_float = glGetUniformLocation(program, "GLYPH_SCALE");
 
-	GLuint TILE_TABLE_usampler2D = glGetUniformLocation(program, "TILE_TABLE");
-	//GLuint PALETTE_TABLE_sampler2D = glGetUniformLocation(program, "PALETTE_TABLE");
+	GLuint TILE_TABLE_sampler2D = glGetUniformLocation(program, "TILE_TABLE");
+	GLuint PALETTE_TABLE_sampler2D = glGetUniformLocation(program, "PALETTE_TABLE");
+	GLuint RECT_TABLE_usampler2D = glGetUniformLocation(program, "RECT_TABLE");
 
 	//bind texture units indices to samplers:
 	glUseProgram(program);
-	glUniform1i(TILE_TABLE_usampler2D, 0);
-	//glUniform1i(PALETTE_TABLE_sampler2D, 1);
+	glUniform1i(TILE_TABLE_sampler2D, 0);
+	glUniform1i(PALETTE_TABLE_sampler2D, 1);
+	glUniform1i(RECT_TABLE_usampler2D, 2);
 	glUseProgram(0);
 
 	GL_ERRORS();
@@ -574,61 +1064,21 @@ PlayMode::PPUTileProgram::~PPUTileProgram() {
 //PPU data is streamed to the GPU (read: uploaded 'just in time') using a few buffers:
 PlayMode::PPUDataStream::PPUDataStream() {
 
-	//vertex_buffer_for_tile_program is a vertex array object that tells the GPU the layout of data in vertex_buffer:
+	//vertex_buffer_for_tile_program is a vertex array object that tells the GPU the layout of glyph instances:
 	glGenVertexArrays(1, &vertex_buffer_for_tile_program);
 	glBindVertexArray(vertex_buffer_for_tile_program);
 
-	//vertex_buffer will (eventually) hold vertex data for drawing:
-	glGenBuffers(1, &vertex_buffer);
-	glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
-
-	//Notice how this binding is attaching an integer input to a floating point attribute:
-	glVertexAttribPointer(
-		tile_program->Position_vec2, //attribute
-		2, //size
-		GL_INT, //type
-		GL_FALSE, //normalized
-		sizeof(Vertex), //stride
-		(GLbyte*)0 + offsetof(Vertex, Position) //offset
-	);
-	glEnableVertexAttribArray(tile_program->Position_vec2);
-
-	//the "I" variant binds to an integer attribute:
-	glVertexAttribIPointer(
-		tile_program->TileCoord_ivec2, //attribute
-		2, //size
-		GL_INT, //type
-		sizeof(Vertex), //stride
-		(GLbyte*)0 + offsetof(Vertex, TileCoord) //offset
-	);
-	glEnableVertexAttribArray(tile_program->TileCoord_ivec2);
-
-	// Add color attribute
-	glVertexAttribPointer(
-		tile_program->Color_vec4, //attribute
-		4, //size
-		GL_FLOAT, //type
-		GL_FALSE, //normalized
-		sizeof(Vertex), //stride
-		(GLbyte*)0 + offsetof(Vertex, Color) //offset
-	);
-	glEnableVertexAttribArray(tile_program->Color_vec4);
-
+	//quad_buffer holds the corners of the unit quad, in triangle strip order:
+	const std::array< glm::u8vec2, 4 > quad = {
+		glm::u8vec2(0, 0), glm::u8vec2(0, 1), glm::u8vec2(1, 0), glm::u8vec2(1, 1)
+	};
+	glGenBuffers(1, &quad_buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, quad_buffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad.data(), GL_STATIC_DRAW);
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	glBindVertexArray(0);
 
-	glGenTextures(1, &tile_tex);
-	glBindTexture(GL_TEXTURE_2D, tile_tex);
-	//passing 'nullptr' to TexImage says "allocate memory but don't store anything there":
-	// (textures will be uploaded later)
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 26, 26, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
-	//make the texture have sharp pixels when magnified:
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	//when access past the edge, clamp to the edge:
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	//(glyph instances are uploaded to the shared StreamBuffer, and attributes pointed at them, when drawing)
+	glBindVertexArray(0);
 
 	GL_ERRORS();
 }
@@ -638,12 +1088,8 @@ PlayMode::PPUDataStream::~PPUDataStream() {
 		glDeleteVertexArrays(1, &vertex_buffer_for_tile_program);
 		vertex_buffer_for_tile_program = 0;
 	}
-	if (vertex_buffer != 0) {
-		glDeleteBuffers(1, &vertex_buffer);
-		vertex_buffer = 0;
-	}
-	if (tile_tex != 0) {
-		glDeleteTextures(1, &tile_tex);
-		tile_tex = 0;
+	if (quad_buffer != 0) {
+		glDeleteBuffers(1, &quad_buffer);
+		quad_buffer = 0;
 	}
 }
@@ -2,10 +2,19 @@
 
 #include "Scene.hpp"
 #include "Sound.hpp"
+#include "GlyphAtlas.hpp"
+#include "WorkerPool.hpp"
+#include "Story.hpp"
 
 #include <vector>
 #include <deque>
 #include <array>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
 
 //#include "../nest-libs/windows/glm/include/glm/glm.hpp"
 //#include "../nest-libs/windows/harfbuzz/include/hb.h"
@@ -43,22 +52,33 @@ struct PlayMode : Mode {
 	};
 
 	//In order to implement the PPU466 on modern graphics hardware, a fancy, special purpose tile-drawing shader is used:
+	// (the SDF variant draws from a signed distance field glyph atlas instead of a coverage atlas)
 	struct PPUTileProgram {
-		PPUTileProgram();
+		enum Variant {
+			Coverage,
+			SDF
+		};
+		PPUTileProgram(Variant variant = Coverage);
 		~PPUTileProgram();
 
 		GLuint program = 0;
 
 		//Attribute (per-vertex variable) locations:
-		GLuint Position_vec2 = -1U;
-		GLuint TileCoord_ivec2 = -1U;
-		GLuint Color_vec4 = -1U;
+		GLuint Corner_vec2 = -1U;
+
+		//Attribute (per-instance variable) locations:
+		GLuint Position_ivec2 = -1U;
+		GLuint Rect_uint = -1U;
+		GLuint Palette_uint = -1U;
 
 		//Uniform (per-invocation variable) locations:
 		GLuint OBJECT_TO_CLIP_mat4 = -1U;
+		GLuint GLYPH_SCALE_float = -1U;
 
 		//Textures bindings:
-		//TEXTURE0 - the tile table (as a 128x128 R8UI texture)
+		//TEXTURE0 - the glyph atlas (as an R8 texture; coverage or distance, depending on variant)
+		//TEXTURE1 - the palette (as a 256x1 RGBA8 texture)
+		//TEXTURE2 - the glyph atlas rect table (as an RGBA16UI texture)
 	};
 
 	//PPU data is streamed to the GPU (read: uploaded 'just in time') using a few buffers:
@@ -66,86 +86,73 @@ struct PlayMode : Mode {
 		PPUDataStream();
 		~PPUDataStream();
 
-		//vertex format for convenience:
-		struct Vertex {
-			Vertex(glm::ivec2 const& Position_, glm::ivec2 const& TileCoord_, glm::u8vec4 Color_)
-				: Position(Position_), TileCoord(TileCoord_), Color(glm::vec4(Color_) / 255.f) { }
+		//instance format: each glyph is drawn as the unit quad, scaled to its rect in the glyph atlas:
+		struct GlyphInstance {
+			GlyphInstance(glm::ivec2 const& Position_, uint32_t Rect_, uint8_t Palette_)
+				: Position(Position_), Rect(uint16_t(Rect_)), Palette(Palette_) { }
 			//I generally make class members lowercase, but I make an exception here because
 			// I use uppercase for vertex attributes in shader programs and want to match.
-			glm::ivec2 Position;
-			glm::ivec2 TileCoord;
-			glm::vec4 Color;
+			glm::ivec2 Position; // lower-left corner of the quad (pixels)
+			uint16_t Rect; // index into the glyph atlas rect table
+			uint8_t Palette; // index into the palette
+			uint8_t Padding = 0;
 		};
+		static_assert(sizeof(GlyphInstance) == 12, "GlyphInstance is packed.");
 
-		//vertex buffer that will store data stream:
-		GLuint vertex_buffer = 0;
+		//static unit quad (as a triangle strip) shared by all glyph instances:
+		GLuint quad_buffer = 0;
 
-		//vertex array object that maps tile program attributes to vertex storage:
+		//vertex array object that maps tile program attributes to quad and instance storage:
+		// (instances are streamed through the shared StreamBuffer)
 		GLuint vertex_buffer_for_tile_program = 0;
-
-		//texture object that will store tile table:
-		GLuint tile_tex = 0;
-	};
-
-	// Struct representing a line of text
-	struct Line {
-		size_t text_start = 0;
-		size_t text_end = 0;
-		bool spoken = false;
-		size_t speaker_start = 0;
-		size_t speaker_end = 0;
-	};
-
-	// Struct that was going to represent a pre- or postcondition of a transition,
-	// but ended up just representing the name of the end state of a transition.
-	// I'm too tired to properly clean this up. Call it stupid code.
-	struct Condition {
-		size_t name_start = 0;
-		size_t name_end = 0;
-		bool negated = false;
 	};
 
-	// Struct representing a transition from a state to a set of new conditions, if preconditions are met
-	// I ended up not needing the preconditions, and the only postcondition I ever used was the state to end up in
-	struct Transition {
-		size_t trigger_start = 0;
-		size_t trigger_end = 0;
-		size_t preconditions_start = 0;
-		size_t preconditions_end = 0;
-		size_t postconditions_start = 0;
-		size_t postconditions_end = 0;
-	};
+	// The story, and the player's way through it (saved to session_path as it goes, and resumed from there on startup)
+	std::unique_ptr< Story > story;
+	std::unique_ptr< Playthrough > playthrough;
+	std::string session_path;
 
-	// Struct representing a game state
-	struct State {
-		std::string name;
-		std::vector<Line> lines;
-		std::vector<Transition> transitions;
-		std::vector<Condition> conditions;
-		std::vector<char> string_data;
+	// States are loaded (paged in from the story bundle, and their text shaped) when they are first needed,
+	// and the states reachable from the current one are loaded ahead of time on the layout pool
+	enum : uint8_t {
+		StateUnloaded,
+		StateLoading,
+		StateLoaded,
 	};
-
-	std::unordered_map<std::string, State> states;
-	std::string current_state;
+	std::vector<std::atomic<uint8_t>> state_status; // indexed by state id
+	int prefetch_depth = 2; // how many transitions ahead to load
 
 	// Struct representing a clickable trigger phrase
 	struct Trigger {
-		std::string name;
+		uint32_t id = 0; // index into trigger_names
 		glm::vec2 position;
 		glm::vec2 size;
 	};
 
-	std::vector<Trigger> triggers;
+	// Trigger phrases are interned, so laid out triggers don't each carry a copy of their name
+	std::vector<std::string> trigger_names;
+	std::unordered_map<std::string, uint32_t> trigger_ids;
+	std::mutex trigger_mutex;
+
+	// Range of glyph instances in an instance buffer
+	struct InstanceRange {
+		size_t first = 0;
+		size_t count = 0;
+	};
 
-	// Struct representing a timeline, including all of the state text inside of it
+	// Struct representing the layout of a timeline, including all of the state text inside of it
 	struct Timeline {
-		int index = 0;
-		int date = 0;
-		std::vector<State> states;
+		int index = 0; // (also the index of the playthrough timeline it shows)
+		std::vector<int> state_tops; // y coordinate of the top of each state's text
+		int layout_y = ScreenHeight; // y coordinate where the next state's text will be laid out
+
+		// Layout index of every line of text in the timeline (the header included), used to find the visible ones
+		std::vector<int> line_tops; // prefix sum of line heights: distance from the top of the timeline to the top of each line, plus the total
+		std::vector<InstanceRange> line_instances; // glyphs of each line in the transcript buffer
+		std::vector<Trigger> triggers; // clickable triggers in the timeline, in layout (top to bottom) order
 	};
 
 	std::vector<Timeline> timelines;
-	size_t current_timeline;
 	int timeline_width = ScreenWidth / 2;
 	int state_width = (int)(timeline_width * 0.95f);
 
@@ -159,7 +166,15 @@ struct PlayMode : Mode {
 	uint32_t char_height = 1;
 	uint32_t min_char = 32;
 	uint32_t max_char = 126;
-	uint32_t num_chars = max_char - min_char + 1;
+
+	// Glyphs are drawn from a signed distance field atlas (rasterized once, at sdf_font_size, and drawn at any scale)
+	// when FreeType supports it, and from a coverage atlas rasterized at font_size otherwise
+	bool sdf_text = true;
+	int sdf_font_size = 32;
+	FT_Face ft_atlas_face = nullptr; // separate face for the distance field atlas, so ft_face keeps its size for shaping
+	int atlas_font_size = 1; // size glyphs in the atlas were rasterized at
+	float glyph_scale = 1.0f; // atlas pixels -> screen pixels
+	std::unique_ptr< GlyphAtlas > glyph_atlas;
 	int font_size = 24;
 
 	int scroll_y = 0;
@@ -168,20 +183,111 @@ struct PlayMode : Mode {
 	int observing_timeline = 0;
 	int scroll_x = 0;
 
-	static inline glm::u8vec4 default_color = glm::u8vec4(0xff, 0xff, 0xc0, 0xff);
+	glm::u8vec4 default_color = glm::u8vec4(0xff, 0xff, 0xc0, 0xff);
 	glm::u8vec4 trigger_color = glm::u8vec4(0xff, 0xff, 0x00, 0xff);
 	glm::u8vec4 date_color = glm::u8vec4(0xc0, 0x00, 0xff, 0xff);
-	glm::u8vec4 angela_color = glm::u8vec4(0xff, 0x80, 0xc0, 0xff);
-	glm::u8vec4 you_color = glm::u8vec4(0x80, 0xff, 0x80, 0xff);
-	glm::u8vec4 z_color = glm::u8vec4(0xc0, 0x00, 0x00, 0xff);
 	glm::u8vec4 timeline_index_color = glm::u8vec4(0xff, 0xff, 0xff, 0xff);
 
+	// Glyphs refer to their color by index into a palette texture built from the colors above,
+	// followed by the color of each of the story's speakers (speaker id i is PaletteSpeakers + i)
+	enum : uint8_t {
+		PaletteDefault,
+		PaletteTrigger,
+		PaletteDate,
+		PaletteTimelineIndex,
+		PaletteSpeakers,
+	};
+	GLuint palette_tex = 0;
+
+	// Struct representing one glyph of shaped text
+	struct ShapedGlyph {
+		uint32_t glyph = 0; // glyph id in the font
+		size_t cluster = 0; // byte offset of the source character in the text
+		glm::ivec2 advance = glm::ivec2(0); // 26.6 fixed point, as reported by Harfbuzz
+		glm::ivec2 offset = glm::ivec2(0); // 26.6 fixed point, as reported by Harfbuzz
+	};
+
+	// Struct representing a piece of text after shaping and word wrapping
+	struct ShapedText {
+		std::vector<ShapedGlyph> glyphs;
+		std::vector<size_t> line_starts; // index of the first glyph on each line
+	};
+
+	// Shaped text is cached so that text that hasn't changed is never reshaped
+	struct ShapedTextKey {
+		std::string text;
+		hb_font_t* font = nullptr;
+		int size = 0;
+		size_t width = 0;
+		bool operator==(const ShapedTextKey& other) const {
+			return text == other.text && font == other.font && size == other.size && width == other.width;
+		}
+	};
+	struct ShapedTextKeyHash {
+		size_t operator()(const ShapedTextKey& key) const {
+			size_t h = std::hash<std::string>()(key.text);
+			h ^= std::hash<hb_font_t*>()(key.font) + 0x9e3779b9 + (h << 6) + (h >> 2);
+			h ^= std::hash<int>()(key.size) + 0x9e3779b9 + (h << 6) + (h >> 2);
+			h ^= std::hash<size_t>()(key.width) + 0x9e3779b9 + (h << 6) + (h >> 2);
+			return h;
+		}
+	};
+	std::unordered_map<ShapedTextKey, ShapedText, ShapedTextKeyHash> shaped_text_cache;
+	std::mutex shaped_text_mutex;
+
+	// Story text is usually shaped ahead of time by the pipeline, leaving only line breaking to do here
+	// (if the bundle was baked with a different font or size, it is shaped here like any other text)
+	bool baked_text = false;
+
+	// Text is laid out (shaped, wrapped and positioned) on a pool of workers, in one job per timeline.
+	// Harfbuzz fonts built on a FreeType face can't be shared between threads, so each worker slot has its own.
+	struct Shaper {
+		FT_Face ft_face = nullptr;
+		hb_font_t* hb_font = nullptr;
+		hb_buffer_t* hb_buffer = nullptr;
+	};
+	std::unique_ptr< WorkerPool > layout_pool;
+	std::vector<Shaper> shapers; // indexed by layout_pool slot
+	size_t mainSlot() const { return layout_pool->slots() - 1; } // slot the main thread uses (ft_face and hb_font)
+
+	// A glyph positioned by layout, before it is looked up in the glyph atlas (which only the main thread can do)
+	struct LaidOutGlyph {
+		glm::ivec2 pen = glm::ivec2(0);
+		uint32_t glyph = 0;
+		uint8_t palette = PaletteDefault;
+	};
+
+	// Transcript text is laid out once, when it is added, into a persistent instance buffer.
+	// Scrolling only changes the OBJECT_TO_CLIP matrix used to draw it.
+	GLuint transcript_buffer = 0;
+	GLuint transcript_buffer_for_tile_program = 0;
+	size_t transcript_capacity = 0; // in glyphs
+	size_t transcript_size = 0; // in glyphs
+	uint32_t transcript_atlas_generation = 0; // atlas generation the transcript was laid out with
+
 	// Helper functions
-	int drawText(std::string text, glm::vec2 position, size_t width, std::vector<PPUDataStream::Vertex>* triangle_strip, glm::u8vec4 color = default_color);
-	void drawTriangleStrip(const std::vector<PPUDataStream::Vertex>& triangle_strip);
-	int drawState(const State& state, glm::ivec2 position, std::vector<PPUDataStream::Vertex>* triangle_strip);
-	void drawTimeline(const Timeline& timeline, std::vector<PPUDataStream::Vertex>* triangle_strip);
-	std::string stateText(const State& state, size_t start, size_t end);
-	std::string lineText(const State& state, size_t line_num);
-	void useTrigger(std::string name);
+	const ShapedText& shapeText(const std::string& text, size_t width, Shaper& shaper);
+	const ShapedText& shapeLine(const Story::State& state, size_t line_num, const std::string& text, size_t width, Shaper& shaper); // text is lineText(state, line_num)
+	const ShapedText& cacheShapedText(ShapedTextKey&& key, ShapedText&& shaped);
+	void breakLines(const std::string& text, size_t width, ShapedText* shaped);
+	int drawText(std::string text, glm::vec2 position, size_t width, Shaper& shaper, std::vector<LaidOutGlyph>* glyphs, uint8_t palette = PaletteDefault, std::vector<Trigger>* triggers = nullptr);
+	int drawShapedText(const std::string& text, const ShapedText& shaped, glm::vec2 position, std::vector<LaidOutGlyph>* glyphs, uint8_t palette, std::vector<Trigger>* triggers);
+	void resolveGlyphs(const LaidOutGlyph* begin, const LaidOutGlyph* end, std::vector<PPUDataStream::GlyphInstance>* instances);
+	void drawGlyphs(const std::vector<PPUDataStream::GlyphInstance>& instances);
+	void drawTiles(GLuint vertex_array, GLuint instance_buffer, const std::vector<InstanceRange>& ranges);
+	int drawLine(const Story::State& state, size_t line_num, glm::ivec2 position, Shaper& shaper, std::vector<LaidOutGlyph>* glyphs, std::vector<Trigger>* triggers);
+	void appendTranscript(const std::vector<PPUDataStream::GlyphInstance>& instances);
+	void validateTranscript();
+	void layoutTimelines();
+	void commitLayout(Timeline& timeline, size_t first_line, const std::vector<LaidOutGlyph>& glyphs);
+	void addLayoutLine(Timeline& timeline, int height, size_t first_instance, size_t instance_count);
+	std::vector<InstanceRange> visibleTranscript(int margin) const;
+	void layoutTimelineHeader(Timeline& timeline, Shaper& shaper, std::vector<LaidOutGlyph>* glyphs);
+	void layoutState(Timeline& timeline, size_t state_index, Shaper& shaper, std::vector<LaidOutGlyph>* glyphs);
+	uint32_t internTrigger(const std::string& name);
+	const Trigger* findTrigger(glm::ivec2 position) const;
+	void useTrigger(uint32_t trigger_id);
+	void saveSession();
+	void loadState(uint32_t state_id, Shaper& shaper);
+	void prefetchSuccessors(uint32_t state_id);
 };
@@ -1,7 +1,8 @@
 #include "Scene.hpp"
 
 #include "gl_errors.hpp"
-#include "read_write_chunk.hpp"
+#include "ChunkView.hpp"
+#include "compressed_chunk.hpp"
 
 #include <glm/gtc/type_ptr.hpp>
 
@@ -169,10 +170,11 @@ void Scene::draw(glm::mat4 const &world_to_clip, glm::mat4x3 const &world_to_lig
 void Scene::load(std::string const &filename,
 	std::function< void(Scene &, Transform *, std::string const &) > const &on_drawable) {
 
-	std::ifstream file(filename, std::ios::binary);
+	//the file is mapped and its chunks used in place (found by name, so they may be in any order);
+	// files exported with --compress have their chunks inflated into a copy instead:
+	ChunkView file(filename, inflate_chunk_copy);
 
-	std::vector< char > names;
-	read_chunk(file, "str0", &names);
+	Span< char const > names = file.find< char >("str0");
 
 	struct HierarchyEntry {
 		uint32_t parent;
@@ -183,8 +185,7 @@ void Scene::load(std::string const &filename,
 		glm::vec3 scale;
 	};
 	static_assert(sizeof(HierarchyEntry) == 4 + 4 + 4 + 4*3 + 4*4 + 4*3, "HierarchyEntry is packed.");
-	std::vector< HierarchyEntry > hierarchy;
-	read_chunk(file, "xfh0", &hierarchy);
+	Span< HierarchyEntry const > hierarchy = file.find< HierarchyEntry >("xfh0");
 
 	struct MeshEntry {
 		uint32_t transform;
@@ -192,8 +193,7 @@ void Scene::load(std::string const &filename,
 		uint32_t name_end;
 	};
 	static_assert(sizeof(MeshEntry) == 4 + 4 + 4, "MeshEntry is packed.");
-	std::vector< MeshEntry > meshes;
-	read_chunk(file, "msh0", &meshes);
+	Span< MeshEntry const > meshes = file.find< MeshEntry >("msh0");
 
 	struct CameraEntry {
 		uint32_t transform;
@@ -202,8 +202,7 @@ void Scene::load(std::string const &filename,
 		float clip_near, clip_far;
 	};
 	static_assert(sizeof(CameraEntry) == 4 + 4 + 4 + 4 + 4, "CameraEntry is packed.");
-	std::vector< CameraEntry > loaded_cameras;
-	read_chunk(file, "cam0", &loaded_cameras);
+	Span< CameraEntry const > loaded_cameras = file.find< CameraEntry >("cam0");
 
 	struct LightEntry {
 		uint32_t transform;
@@ -214,8 +213,7 @@ void Scene::load(std::string const &filename,
 		float fov;
 	};
 	static_assert(sizeof(LightEntry) == 4 + 1 + 3 + 4 + 4 + 4, "LightEntry is packed.");
-	std::vector< LightEntry > loaded_lights;
-	read_chunk(file, "lmp0", &loaded_lights);
+	Span< LightEntry const > loaded_lights = file.find< LightEntry >("lmp0");
 
 
 	//--------------------------------
@@ -303,10 +301,7 @@ void Scene::load(std::string const &filename,
 
 	//load any extra that a subclass wants:
 	load_extra(file, names, hierarchy_transforms);
-
-	if (file.peek() != EOF) {
-		std::cerr << "WARNING: trailing data in scene file '" << filename << "'" << std::endl;
-	}
+	//(chunks are found by name, so other chunks in the file are just ignored)
 
 
 
@@ -11,6 +11,7 @@
  */
 
 #include "GL.hpp"
+#include "ChunkView.hpp"
 
 #include <glm/glm.hpp>
 #include <glm/gtc/quaternion.hpp>
@@ -137,7 +138,9 @@ struct Scene {
 
 	//this function is called to read extra chunks from the scene file after the main chunks are read:
 	// this is useful if you, e.g., subclassing scene to represent a game level/area
-	virtual void load_extra(std::istream &from, std::vector< char > const &str0, std::vector< Transform * > const &xfh0) { }
+	// (read them with from.find< T >(magic), or with from.next< T >(magic), which carries on after the last chunk Scene::load found ("lmp0");
+	//  the spans they return are only valid during the call)
+	virtual void load_extra(ChunkView &from, Span< char const > str0, std::vector< Transform * > const &xfh0) { }
 
 	//empty scene:
 	Scene() = default;
@@ -0,0 +1,38 @@
+#pragma once
+
+/*
+ * Span -- a view of a contiguous array of T owned by something else
+ *  (e.g., data in a memory-mapped file).
+ *
+ * (stands in for C++20's std::span)
+ *
+ */
+
+#include <cassert>
+#include <cstddef>
+
+template< typename T >
+struct Span {
+	Span() = default;
+	Span(T *first_, size_t count_) : first(first_), count(count_) { }
+
+	T *begin() const { return first; }
+	T *end() const { return first + count; }
+	T *data() const { return first; }
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+
+	T &operator[](size_t i) const {
+		assert(i < count);
+		return first[i];
+	}
+
+	//elements [begin_index, end_index):
+	Span slice(size_t begin_index, size_t end_index) const {
+		assert(begin_index <= end_index && end_index <= count);
+		return Span(first + begin_index, end_index - begin_index);
+	}
+
+	T *first = nullptr;
+	size_t count = 0;
+};
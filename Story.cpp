@@ -0,0 +1,315 @@
+#include "Story.hpp"
+
+#include "read_write_chunk.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+Story::Story(const std::string& path) : bundle(path) {
+	Span<const Header> header = bundle.find<Header>("stry");
+	if (header.size() != 1 || header[0].version != Version) {
+		throw std::runtime_error("Story bundle '" + path + "' has an unexpected header or version.");
+	}
+	Span<const StateEntry> toc = bundle.find<StateEntry>("stat");
+	Span<const Name> trigger_name_table = bundle.find<Name>("tnam");
+	lines = bundle.find<Line>("line");
+	transitions = bundle.find<Transition>("tran");
+	conditions = bundle.find<Condition>("cond");
+	edges = bundle.find<Edge>("edge");
+	Span<const Name> flag_name_table = bundle.find<Name>("fnam");
+	flag_terms = bundle.find<FlagTerm>("term");
+	flag_dependencies = bundle.find<FlagDependency>("fdep");
+	glyphs = bundle.find<Glyph>("glyf");
+	speakers = bundle.find<Speaker>("spkr");
+	strings = bundle.find<char>("strn");
+	if (toc.size() != header[0].state_count || trigger_name_table.size() != header[0].trigger_count || header[0].start_state >= toc.size()
+		|| flag_name_table.size() != header[0].flag_count || header[0].flag_words != (header[0].flag_count + 63) / 64
+		|| glyphs.size() != header[0].glyph_count) {
+		throw std::runtime_error("Story bundle table of contents doesn't match its header.");
+	}
+	start_state = header[0].start_state;
+	flag_count = header[0].flag_count;
+	flag_words = header[0].flag_words;
+	font_size = header[0].font_size;
+	font_hash = header[0].font_hash;
+	fingerprint = hashBytes(reinterpret_cast<const char*>(header.data()), sizeof(Header));
+	fingerprint = hashBytes(reinterpret_cast<const char*>(toc.data()), toc.size() * sizeof(StateEntry), fingerprint);
+
+	// Only the header and table of contents are checked here, so loading doesn't page in the rest of the bundle:
+	// edges are checked by checkEdges() when a playthrough starts, and lines by lineText() as they are shown
+
+	for (const Name& name : trigger_name_table) {
+		trigger_names.push_back(text(name.start, name.end));
+	}
+	for (const Name& name : flag_name_table) {
+		flag_names.push_back(text(name.start, name.end));
+	}
+
+	states.resize(toc.size());
+	for (size_t i = 0; i < states.size(); i++) {
+		const StateEntry& entry = toc[i];
+		if (entry.lines_start > entry.lines_end || entry.lines_end > lines.size()
+			|| entry.transitions_start > entry.transitions_end || entry.transitions_end > transitions.size()
+			|| entry.edges_start > entry.edges_end || entry.edges_end > edges.size()) {
+			throw std::runtime_error("Story bundle has a state with out-of-range lines, transitions or edges.");
+		}
+		State& state = states[i];
+		state.name = text(entry.name.start, entry.name.end);
+		state.lines = lines.slice(entry.lines_start, entry.lines_end);
+		state.transitions = transitions.slice(entry.transitions_start, entry.transitions_end);
+		state.edges = edges.slice(entry.edges_start, entry.edges_end);
+		state.depth = entry.depth;
+		state.timeline_date = entry.timeline_date;
+	}
+}
+
+std::string_view Story::text(size_t start, size_t end) const {
+	if (start > end || end > strings.size()) {
+		throw std::runtime_error("Story text range is out of bounds.");
+	}
+	return std::string_view(strings.data() + start, end - start);
+}
+
+std::string Story::lineText(const State& state, size_t line_num) const {
+	Line line = state.lines[line_num];
+	checkLine(line);
+	std::string ret = "";
+	if (line.spoken) {
+		ret = std::string(text(line.speaker_start, line.speaker_end)) + ": ";
+	}
+	return ret.append(text(line.text_start, line.text_end));
+}
+
+void Story::checkLine(const Line& line) const {
+	if (line.glyphs_start > line.glyphs_end || line.glyphs_end > glyphs.size() || (line.spoken && line.speaker >= speakers.size())) {
+		throw std::runtime_error("Story bundle has a line with out-of-range glyphs or speaker.");
+	}
+	size_t length = text(line.text_start, line.text_end).size();
+	if (line.spoken) {
+		length += text(line.speaker_start, line.speaker_end).size() + 2; // (for ": ")
+	}
+	// Baked clusters index the displayed text, so they have to stay inside it (and in order)
+	uint32_t last_cluster = 0;
+	for (const Glyph& glyph : glyphs.slice(line.glyphs_start, line.glyphs_end)) {
+		if (glyph.cluster >= length || glyph.cluster < last_cluster) {
+			throw std::runtime_error("Story bundle has a baked glyph outside of its line's text.");
+		}
+		last_cluster = glyph.cluster;
+	}
+}
+
+void Story::checkEdges() const {
+	for (const Edge& edge : edges) {
+		if (edge.target >= states.size() || edge.trigger >= trigger_names.size()
+			|| edge.guards_start > edge.guards_end || edge.guards_end > flag_terms.size()
+			|| edge.effects_start > edge.effects_end || edge.effects_end > flag_terms.size()) {
+			throw std::runtime_error("Story bundle has an edge with an out-of-range target, trigger or flag terms.");
+		}
+	}
+	for (const FlagTerm& term : flag_terms) {
+		if (term.word >= flag_words) {
+			throw std::runtime_error("Story bundle has a flag term for a flag that doesn't exist.");
+		}
+	}
+	for (const FlagDependency& dependency : flag_dependencies) {
+		if (dependency.edge >= edges.size() || dependency.flag >= flag_count) {
+			throw std::runtime_error("Story bundle has a flag dependency that doesn't exist.");
+		}
+	}
+}
+
+void Story::validate() const {
+	checkEdges();
+	for (const Line& line : lines) {
+		checkLine(line);
+	}
+}
+
+bool Story::baked(const std::string& font_path, uint32_t size) const {
+	return font_hash != 0 && font_size == size && font_hash == hashFile(font_path);
+}
+
+uint64_t Story::hashFile(const std::string& path) {
+	MappedFile mapped(path);
+	return hashBytes(mapped.data, mapped.size);
+}
+
+uint64_t Story::hashBytes(const char* data, size_t size, uint64_t hash) {
+	for (size_t i = 0; i < size; i++) {
+		hash = (hash ^ (uint8_t)data[i]) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+Playthrough::Playthrough(const Story& story_) : story(story_) {
+	// Every edge's guards are evaluated from the start, so this is where edges are first used
+	story.checkEdges();
+	restart();
+}
+
+void Playthrough::restart() {
+	current_state = story.start_state;
+	timelines.resize(1);
+	timelines[0].date = story.states[current_state].timeline_date;
+	timelines[0].state_ids.assign(1, current_state);
+	current_timeline = 0;
+
+	// All flags start clear
+	flags.assign(story.flag_words, 0);
+	edge_live.resize(story.edges.size());
+	for (size_t i = 0; i < story.edges.size(); i++) {
+		edge_live[i] = guardsHold(story.edges[i]);
+	}
+}
+
+const Story::Edge* Playthrough::liveEdge(uint32_t trigger_id) const {
+	// Transitions are compiled by the pipeline into a table sorted by trigger id
+	const Story::State& state = story.states[current_state];
+	auto edge = std::lower_bound(state.edges.begin(), state.edges.end(), trigger_id, [](const Story::Edge& e, uint32_t trigger) {
+		return e.trigger < trigger;
+	});
+	while (edge != state.edges.end() && edge->trigger == trigger_id && !edge_live[story.edgeIndex(*edge)]) {
+		edge++;
+	}
+	if (edge == state.edges.end() || edge->trigger != trigger_id) {
+		return nullptr;
+	}
+	return edge;
+}
+
+const Story::Edge* Playthrough::useTrigger(uint32_t trigger_id) {
+	const Story::Edge* edge = liveEdge(trigger_id);
+	if (!edge) {
+		return nullptr;
+	}
+	applyEffects(*edge);
+
+	// Time travel is marked on the states it leads to
+	current_state = edge->target;
+	if (story.states[current_state].timeline_date != 0) {
+		timelines.emplace_back();
+		timelines.back().date = story.states[current_state].timeline_date;
+		current_timeline = (uint32_t)timelines.size() - 1;
+	}
+	timelines[current_timeline].state_ids.push_back(current_state);
+	return edge;
+}
+
+bool Playthrough::guardsHold(const Story::Edge& edge) const {
+	for (uint32_t i = edge.guards_start; i < edge.guards_end; i++) {
+		const Story::FlagTerm& term = story.flag_terms[i];
+		if ((flags[term.word] & term.mask) != term.value) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void Playthrough::applyEffects(const Story::Edge& edge) {
+	for (uint32_t i = edge.effects_start; i < edge.effects_end; i++) {
+		const Story::FlagTerm& term = story.flag_terms[i];
+		uint64_t old_word = flags[term.word];
+		flags[term.word] = (old_word & ~term.mask) | term.value;
+
+		// Check again just the edges that depend on flags that actually changed
+		uint64_t changed = old_word ^ flags[term.word];
+		for (uint32_t bit = 0; changed != 0; bit++, changed >>= 1) {
+			if (!(changed & 1)) {
+				continue;
+			}
+			uint32_t flag = (uint32_t)term.word * 64 + bit;
+			auto dependents = std::equal_range(story.flag_dependencies.begin(), story.flag_dependencies.end(), Story::FlagDependency{ flag, 0 },
+				[](const Story::FlagDependency& a, const Story::FlagDependency& b) {
+					return a.flag < b.flag;
+				});
+			for (auto dependency = dependents.first; dependency != dependents.second; dependency++) {
+				edge_live[dependency->edge] = guardsHold(story.edges[dependency->edge]);
+			}
+		}
+	}
+}
+
+void Playthrough::save(const std::string& path, const View& view) const {
+	SessionHeader header;
+	header.version = SessionVersion;
+	header.current_timeline = current_timeline;
+	header.story_fingerprint = story.fingerprint;
+	header.current_state = current_state;
+	header.view = view;
+
+	std::vector<SessionTimeline> session_timelines;
+	std::vector<uint32_t> state_ids;
+	for (const Timeline& timeline : timelines) {
+		SessionTimeline entry;
+		entry.date = timeline.date;
+		entry.state_ids_start = (uint32_t)state_ids.size();
+		state_ids.insert(state_ids.end(), timeline.state_ids.begin(), timeline.state_ids.end());
+		entry.state_ids_end = (uint32_t)state_ids.size();
+		session_timelines.push_back(entry);
+	}
+
+	std::string temp_path = path + ".tmp";
+	{
+		std::ofstream ofile(temp_path, std::ios::binary);
+		write_chunk_file_header(&ofile, 8, ChunkFormat::ChunkChecksums);
+		write_chunk("sess", std::vector<SessionHeader>{ header }, &ofile);
+		write_chunk("tlin", session_timelines, &ofile);
+		write_chunk("flag", flags, &ofile);
+		write_chunk("sids", state_ids, &ofile);
+		if (!ofile) {
+			throw std::runtime_error("Couldn't write the session to '" + temp_path + "'.");
+		}
+	}
+	std::filesystem::rename(temp_path, path);
+}
+
+bool Playthrough::resume(const std::string& path, View* view) {
+	if (!std::filesystem::exists(path)) {
+		return false;
+	}
+	try {
+		ChunkView session(path);
+		Span<const SessionHeader> header = session.next<SessionHeader>("sess");
+		Span<const SessionTimeline> session_timelines = session.next<SessionTimeline>("tlin");
+		Span<const uint64_t> session_flags = session.next<uint64_t>("flag");
+		Span<const uint32_t> state_ids = session.next<uint32_t>("sids");
+		if (header.size() != 1 || header[0].version != SessionVersion || header[0].story_fingerprint != story.fingerprint
+			|| session_flags.size() != story.flag_words || header[0].current_timeline >= session_timelines.size()) {
+			throw std::runtime_error("it is for another version of the story");
+		}
+		for (const SessionTimeline& timeline : session_timelines) {
+			if (timeline.state_ids_start >= timeline.state_ids_end || timeline.state_ids_end > state_ids.size()) {
+				throw std::runtime_error("it has a timeline with out-of-range states");
+			}
+		}
+		for (uint32_t state_id : state_ids) {
+			if (state_id >= story.states.size()) {
+				throw std::runtime_error("it has a state that doesn't exist");
+			}
+		}
+		const SessionTimeline& current = session_timelines[header[0].current_timeline];
+		if (header[0].current_state != state_ids[current.state_ids_end - 1]) {
+			throw std::runtime_error("its current state isn't the last one of its timeline");
+		}
+
+		timelines.resize(session_timelines.size());
+		for (size_t i = 0; i < timelines.size(); i++) {
+			timelines[i].date = session_timelines[i].date;
+			timelines[i].state_ids.assign(state_ids.begin() + session_timelines[i].state_ids_start, state_ids.begin() + session_timelines[i].state_ids_end);
+		}
+		current_timeline = header[0].current_timeline;
+		current_state = header[0].current_state;
+		flags.assign(session_flags.begin(), session_flags.end());
+		for (size_t i = 0; i < story.edges.size(); i++) {
+			edge_live[i] = guardsHold(story.edges[i]);
+		}
+		*view = header[0].view;
+	} catch (std::runtime_error& e) {
+		std::cerr << "WARNING: not resuming the session saved in '" << path << "': " << e.what() << std::endl;
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,264 @@
+#pragma once
+
+/*
+ * Story -- the story bundle written by the pipeline, and the rules for
+ *  playing through it.
+ *
+ * Nothing here needs graphics, fonts or a window, so the same story logic
+ *  runs in the game (PlayMode), in the pipeline, and in story-sim.
+ *
+ */
+
+#include "ChunkView.hpp"
+#include "Span.hpp"
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct Story {
+	// Map the story bundle at 'path' and check its header and table of contents; throws std::runtime_error if it is missing or malformed
+	// (the rest is checked as it is used, so only the parts of the bundle that are needed get paged in)
+	explicit Story(const std::string& path);
+
+	// Struct representing a line of text
+	struct Line {
+		size_t text_start = 0;
+		size_t text_end = 0;
+		bool spoken = false;
+		uint8_t padding[3] = { 0, 0, 0 }; // (explicit, so the pipeline's output only depends on its input)
+		uint32_t speaker = 0; // index into speakers (if spoken)
+		size_t speaker_start = 0;
+		size_t speaker_end = 0;
+		size_t glyphs_start = 0; // range of glyphs (empty if the bundle has no baked text)
+		size_t glyphs_end = 0;
+	};
+
+	// Glyph of a line's text (as returned by lineText), shaped with HarfBuzz by the pipeline
+	struct Glyph {
+		uint32_t glyph = 0; // glyph id in the font
+		uint32_t cluster = 0; // byte offset of the source character in the text
+		int32_t x_advance = 0; // 26.6 fixed point, as reported by Harfbuzz
+		int32_t y_advance = 0;
+		int32_t x_offset = 0;
+		int32_t y_offset = 0;
+	};
+
+	// Struct representing a pre- or postcondition of a transition: the name of a world flag
+	// (required to be set, or clear if negated), except that the first postcondition names the end state
+	struct Condition {
+		size_t name_start = 0;
+		size_t name_end = 0;
+		bool negated = false;
+		uint8_t padding[7] = { 0, 0, 0, 0, 0, 0, 0 };
+	};
+
+	// Struct representing a transition from a state to a set of new conditions, if preconditions are met
+	struct Transition {
+		size_t trigger_start = 0;
+		size_t trigger_end = 0;
+		size_t preconditions_start = 0;
+		size_t preconditions_end = 0;
+		size_t postconditions_start = 0;
+		size_t postconditions_end = 0;
+	};
+
+	// World flags are bits in a bitset of 64-bit words; conditions on them are compiled to one FlagTerm per word touched.
+	// As a precondition, a term holds when (flags[word] & mask) == value;
+	// as a postcondition, it updates the word to (flags[word] & ~mask) | value.
+	struct FlagTerm {
+		uint64_t word = 0;
+		uint64_t mask = 0;
+		uint64_t value = 0;
+	};
+
+	// Transition compiled by the pipeline: using the trigger leads to the target state,
+	// as long as all of the guard terms hold, and then applies the effect terms
+	struct Edge {
+		uint32_t trigger = 0; // trigger id (index into trigger_names)
+		uint32_t target = 0; // state id (index into states)
+		uint32_t guards_start = 0; // range of flag_terms
+		uint32_t guards_end = 0;
+		uint32_t effects_start = 0;
+		uint32_t effects_end = 0;
+	};
+
+	// Entry of the index from flags to the edges whose guards test them
+	struct FlagDependency {
+		uint32_t flag = 0;
+		uint32_t edge = 0; // index into edges
+	};
+
+	// Range of a name in the story's string data
+	struct Name {
+		size_t start = 0;
+		size_t end = 0;
+	};
+
+	// Someone who speaks lines, and the color their lines are drawn in (from speakers.txt)
+	struct Speaker {
+		Name name;
+		uint8_t color[4] = { 0xff, 0xff, 0xff, 0xff }; // RGBA
+		uint32_t padding = 0;
+	};
+
+	// The whole story is one bundle file, written by the pipeline as a set of chunks (found through its table of contents):
+	//  "stry" - Header
+	//  "stat" - StateEntry for each state id (the table of contents)
+	//  "tnam" - Name of each trigger id
+	//  "line", "tran", "cond", "edge" - Lines, Transitions, Conditions and Edges of every state
+	//  "fnam" - Name of each flag
+	//  "term" - FlagTerms of every edge
+	//  "fdep" - FlagDependencies, sorted by flag
+	//  "glyf" - Glyphs of every line, if the text was baked (shaped by the pipeline)
+	//  "spkr" - Speaker for each speaker id
+	//  "strn" - all of the story's text (every string offset above points here)
+	// It is a v2 chunk file (see read_write_chunk.hpp) with 16-byte aligned payloads, so it is used in place through a memory mapping.
+	// (v1 bundles load too: every element type is a multiple of 8 bytes, as are v1 chunk headers, which keeps their data aligned)
+	enum : uint32_t {
+		Version = 6,
+		UnreachableDepth = 0xffffffff
+	};
+	struct Header {
+		uint32_t version = 0;
+		uint32_t state_count = 0;
+		uint32_t trigger_count = 0;
+		uint32_t start_state = 0;
+		uint32_t flag_count = 0;
+		uint32_t flag_words = 0; // (flag_count + 63) / 64
+		uint32_t font_size = 0; // size baked text was shaped at
+		uint32_t glyph_count = 0;
+		uint64_t font_hash = 0; // hashFile() of the font baked text was shaped with, or 0 if the text wasn't baked
+	};
+	struct StateEntry {
+		Name name;
+		size_t lines_start = 0;
+		size_t lines_end = 0;
+		size_t transitions_start = 0;
+		size_t transitions_end = 0;
+		size_t edges_start = 0;
+		size_t edges_end = 0; // (so out-degree is edges_end - edges_start)
+		uint32_t depth = 0; // fewest transitions needed to get here from start, or UnreachableDepth
+		int32_t timeline_date = 0; // if not 0, entering this state starts a new timeline in this year
+	};
+	static_assert(sizeof(Header) % 8 == 0 && sizeof(StateEntry) % 8 == 0 && sizeof(Line) % 8 == 0
+		&& sizeof(Transition) % 8 == 0 && sizeof(Condition) % 8 == 0 && sizeof(Edge) % 8 == 0 && sizeof(Name) % 8 == 0
+		&& sizeof(FlagTerm) % 8 == 0 && sizeof(FlagDependency) % 8 == 0 && sizeof(Glyph) % 8 == 0 && sizeof(Speaker) % 8 == 0,
+		"Story bundle chunks keep their data 8-byte aligned.");
+
+	// Struct representing a game state (a view of its part of the story bundle)
+	struct State {
+		std::string_view name;
+		Span<const Line> lines;
+		Span<const Transition> transitions;
+		Span<const Edge> edges; // sorted by trigger (the first live edge for a trigger is the one used)
+		uint32_t depth = 0;
+		int32_t timeline_date = 0;
+	};
+
+	std::vector<State> states; // indexed by state id
+	uint32_t start_state = 0;
+	std::vector<std::string_view> trigger_names; // indexed by trigger id
+	std::vector<std::string_view> flag_names; // indexed by flag
+	uint32_t flag_count = 0;
+	uint32_t flag_words = 0;
+	uint32_t font_size = 0;
+	uint64_t font_hash = 0;
+	uint64_t fingerprint = 0; // hash of the header and table of contents, to tell saved sessions of another story apart
+
+	ChunkView bundle; // (everything above points into its mapping)
+	Span<const Line> lines;
+	Span<const Transition> transitions;
+	Span<const Condition> conditions;
+	Span<const Edge> edges;
+	Span<const FlagTerm> flag_terms;
+	Span<const FlagDependency> flag_dependencies;
+	Span<const Glyph> glyphs;
+	Span<const Speaker> speakers;
+	Span<const char> strings;
+
+	// Helper functions
+	std::string_view text(size_t start, size_t end) const;
+	std::string lineText(const State& state, size_t line_num) const; // with "Speaker: " in front, if spoken (throws if the line is malformed)
+	uint32_t edgeIndex(const Edge& edge) const { return uint32_t(&edge - edges.data()); }
+	bool baked(const std::string& font_path, uint32_t size) const; // was the text shaped with this font, at this size?
+
+	// Checks of the parts of the bundle that aren't checked on load; throw std::runtime_error if something is out of range
+	void checkLine(const Line& line) const; // text and speaker ranges, and that baked clusters stay inside the text
+	void checkEdges() const; // edges, flag terms and flag dependencies (Playthrough does this)
+	void validate() const; // everything (reads the whole bundle, so it's for tools like story-sim rather than the game)
+
+	// 64-bit FNV-1a hash of a file's contents (used to tell whether baked text matches a font)
+	static uint64_t hashFile(const std::string& path);
+	static uint64_t hashBytes(const char* data, size_t size, uint64_t hash = 0xcbf29ce484222325ULL);
+};
+
+// One player's way through a story: the states visited in each timeline, and the world flags
+struct Playthrough {
+	// Starts in the story's start state, in a timeline dated by the start state, with all flags clear
+	explicit Playthrough(const Story& story);
+	const Story& story;
+
+	struct Timeline {
+		int32_t date = 0;
+		std::vector<uint32_t> state_ids; // states visited in this timeline, in order
+	};
+	std::vector<Timeline> timelines;
+	uint32_t current_timeline = 0;
+	uint32_t current_state = 0;
+
+	// World state: flags set and cleared by transitions, which other transitions may require
+	std::vector<uint64_t> flags; // bit (flag % 64) of word (flag / 64)
+	std::vector<bool> edge_live; // indexed like story.edges: whether the edge's guards currently hold
+	// (kept up to date incrementally: when flags change, only the edges that depend on them are checked again)
+
+	// Use a trigger in the current state; returns the edge taken, or nullptr if the trigger doesn't lead anywhere right now.
+	// If the new state starts a new timeline, that timeline is added and becomes current.
+	const Story::Edge* useTrigger(uint32_t trigger_id);
+
+	// Back to the start (keeps allocations, so repeated playthroughs are cheap)
+	void restart();
+
+	// Where the player was looking; saved with the session, but otherwise up to the game
+	struct View {
+		int32_t scroll_x = 0;
+		int32_t scroll_y = 0;
+		int32_t timeline = 0;
+	};
+
+	// A session is saved as a small (v2, checksummed) chunk file holding the state ids of each timeline, the flags and the view:
+	//  "sess" - SessionHeader
+	//  "tlin" - SessionTimeline for each timeline
+	//  "flag" - flag words
+	//  "sids" - state ids of every timeline
+	// Resuming maps the file and copies the ids back, so it doesn't depend on how the session got there.
+	enum : uint32_t {
+		SessionVersion = 1
+	};
+	struct SessionHeader {
+		uint32_t version = 0;
+		uint32_t current_timeline = 0;
+		uint64_t story_fingerprint = 0;
+		uint32_t current_state = 0;
+		View view;
+	};
+	struct SessionTimeline {
+		int32_t date = 0;
+		uint32_t state_ids_start = 0; // range of "sids"
+		uint32_t state_ids_end = 0;
+		uint32_t padding = 0;
+	};
+	static_assert(sizeof(SessionHeader) % 8 == 0 && sizeof(SessionTimeline) % 8 == 0, "Session chunks keep their data 8-byte aligned.");
+
+	// Write the session (to a temporary file that then replaces 'path', so an interrupted save doesn't lose the old one)
+	void save(const std::string& path, const View& view) const;
+	// Resume the session saved at 'path'; returns false, leaving the playthrough as it was,
+	// if there isn't one or it doesn't fit this story
+	bool resume(const std::string& path, View* view);
+
+	// Helper functions
+	const Story::Edge* liveEdge(uint32_t trigger_id) const;
+	bool guardsHold(const Story::Edge& edge) const;
+	void applyEffects(const Story::Edge& edge);
+};
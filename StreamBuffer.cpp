@@ -0,0 +1,143 @@
+#include "StreamBuffer.hpp"
+
+#include "Load.hpp"
+#include "gl_errors.hpp"
+
+#include <cassert>
+#include <cstring>
+#include <iostream>
+
+static StreamBuffer *shared_stream_buffer = nullptr;
+
+static Load< void > setup_shared_stream_buffer(LoadTagEarly, [](){
+	shared_stream_buffer = new StreamBuffer();
+});
+
+StreamBuffer &StreamBuffer::shared() {
+	assert(shared_stream_buffer && "StreamBuffer::shared() used before load functions were called.");
+	return *shared_stream_buffer;
+}
+
+StreamBuffer::StreamBuffer(GLsizeiptr capacity_) {
+	assert(capacity_ > 0);
+	grow(capacity_);
+}
+
+StreamBuffer::~StreamBuffer() {
+	for (auto &f : fences) {
+		glDeleteSync(f.sync);
+	}
+	fences.clear();
+	if (buffer != 0) {
+		glDeleteBuffers(1, &buffer);
+		buffer = 0;
+	}
+}
+
+GLintptr StreamBuffer::upload(void const *data, GLsizeiptr size, GLsizeiptr alignment) {
+	assert(size >= 0);
+	assert(alignment > 0);
+
+	//uploads bigger than the whole ring get a bigger ring:
+	if (size > capacity) {
+		GLsizeiptr new_capacity = capacity;
+		while (new_capacity < size) new_capacity *= 2;
+		grow(new_capacity);
+	}
+
+	//align the start of the upload, skipping to the start of the ring if it would run off the end:
+	uint64_t offset = head % uint64_t(capacity);
+	uint64_t aligned = (offset + uint64_t(alignment) - 1) / uint64_t(alignment) * uint64_t(alignment);
+	uint64_t start = head + (aligned - offset);
+	if (aligned + uint64_t(size) > uint64_t(capacity)) {
+		start = head + (uint64_t(capacity) - offset);
+	}
+	uint64_t end = start + uint64_t(size);
+
+	//wait until the GPU is done with whatever was there before:
+	while (end - (fences.empty() ? frame_start : fences.front().start) > uint64_t(capacity)) {
+		if (fences.empty() && frame_start == head) {
+			//nothing is in use, so only skipped space is in the way:
+			frame_start = head = start;
+			break;
+		}
+		//(if the current frame's uploads are in the way, fence them so they can be waited on)
+		if (fences.empty()) fence();
+		wait();
+	}
+	head = end;
+
+	GLintptr at = GLintptr(start % uint64_t(capacity));
+	if (size == 0) return at;
+
+	glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+	void *mapped = glMapBufferRange(GL_COPY_WRITE_BUFFER, at, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	if (mapped) {
+		std::memcpy(mapped, data, size_t(size));
+		if (glUnmapBuffer(GL_COPY_WRITE_BUFFER) == GL_FALSE) {
+			//(buffer contents were lost, e.g. because of a display mode change; this upload will be re-sent next frame anyway)
+			std::cerr << "WARNING: stream buffer contents were lost during upload." << std::endl;
+		}
+	} else {
+		//mapping can fail (e.g., out of address space); upload the slow way instead:
+		glBufferSubData(GL_COPY_WRITE_BUFFER, at, size, data);
+	}
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+	GL_ERRORS();
+
+	return at;
+}
+
+void StreamBuffer::end_frame() {
+	fence();
+}
+
+void StreamBuffer::fence() {
+	if (head == frame_start) return;
+	Fence f;
+	f.sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	f.start = frame_start;
+	fences.emplace_back(f);
+	frame_start = head;
+}
+
+void StreamBuffer::wait() {
+	assert(!fences.empty());
+	GLbitfield flags = GL_SYNC_FLUSH_COMMANDS_BIT;
+	while (true) {
+		GLenum result = glClientWaitSync(fences.front().sync, flags, 1000000000 /* 1s, in ns */);
+		if (result == GL_ALREADY_SIGNALED || result == GL_CONDITION_SATISFIED) break;
+		if (result == GL_WAIT_FAILED) {
+			std::cerr << "WARNING: waiting for stream buffer fence failed." << std::endl;
+			break;
+		}
+		//(commands were flushed by the first wait, so no need to flush again)
+		flags = 0;
+	}
+	glDeleteSync(fences.front().sync);
+	fences.pop_front();
+}
+
+void StreamBuffer::grow(GLsizeiptr new_capacity) {
+	//old storage stays alive (in the driver) until draws using it are done, so nothing needs to wait:
+	for (auto &f : fences) {
+		glDeleteSync(f.sync);
+	}
+	fences.clear();
+	if (buffer != 0) {
+		glDeleteBuffers(1, &buffer);
+		buffer = 0;
+	}
+
+	glGenBuffers(1, &buffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+	glBufferData(GL_COPY_WRITE_BUFFER, new_capacity, NULL, GL_STREAM_DRAW);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+	capacity = new_capacity;
+	head = 0;
+	frame_start = 0;
+
+	GL_ERRORS();
+}
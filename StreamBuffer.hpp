@@ -0,0 +1,58 @@
+#pragma once
+
+/*
+ * StreamBuffer -- a ring of buffer storage for geometry that is uploaded,
+ *  drawn, and thrown away (e.g., DrawLines vertices, per-frame text).
+ *
+ * Uploads are written with glMapBufferRange(..., GL_MAP_UNSYNCHRONIZED_BIT),
+ *  so the driver never has to reallocate storage or stall on it; instead,
+ *  the end of each frame's data is marked with a fence, and space is only
+ *  reused once the fence guarding it has passed.
+ *
+ * Usage:
+ *   GLintptr offset = StreamBuffer::shared().upload(data, bytes, sizeof(Vertex));
+ *   //...point attributes at StreamBuffer::shared().buffer + offset and draw...
+ *   //once per frame, after drawing (e.g., just before swapping buffers):
+ *   StreamBuffer::shared().end_frame();
+ *
+ */
+
+#include "GL.hpp"
+
+#include <cstdint>
+#include <deque>
+
+struct StreamBuffer {
+	StreamBuffer(GLsizeiptr capacity = 4 << 20);
+	~StreamBuffer();
+
+	//copy 'size' bytes into the ring, returning their offset in 'buffer':
+	// (offset is a multiple of 'alignment', so it can be used as a first vertex)
+	// (NOTE: 'buffer' may change if an upload doesn't fit in the ring, so bind it after uploading)
+	GLintptr upload(void const *data, GLsizeiptr size, GLsizeiptr alignment = 16);
+
+	//mark everything uploaded so far as belonging to the frame that was just drawn:
+	void end_frame();
+
+	GLuint buffer = 0;
+	GLsizeiptr capacity = 0;
+
+	//-- internals --
+	//positions count bytes ever uploaded (so they only increase); position % capacity is the offset in the buffer:
+	uint64_t head = 0; //where the next upload goes
+	uint64_t frame_start = 0; //where uploads since the last fence began
+
+	//uploads that may still be in use by the GPU, oldest first:
+	struct Fence {
+		GLsync sync = 0;
+		uint64_t start = 0; //position of the first upload before the fence
+	};
+	std::deque< Fence > fences;
+
+	void fence(); //fence everything uploaded since the last fence
+	void wait(); //wait for the oldest fence
+	void grow(GLsizeiptr new_capacity);
+
+	//buffer shared by everything in the program (created at LoadTagEarly):
+	static StreamBuffer &shared();
+};
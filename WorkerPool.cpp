@@ -0,0 +1,110 @@
+#include "WorkerPool.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <exception>
+#include <memory>
+
+size_t WorkerPool::default_worker_count() {
+	unsigned int hardware = std::thread::hardware_concurrency();
+	return (hardware > 1 ? hardware - 1 : 0);
+}
+
+WorkerPool::WorkerPool(size_t worker_count) {
+	workers.reserve(worker_count);
+	for (size_t i = 0; i < worker_count; ++i) {
+		workers.emplace_back(&WorkerPool::worker_main, this, i);
+	}
+}
+
+WorkerPool::~WorkerPool() {
+	{
+		std::unique_lock< std::mutex > lock(mutex);
+		quit = true;
+	}
+	tasks_cv.notify_all();
+	for (auto &worker : workers) {
+		worker.join();
+	}
+}
+
+void WorkerPool::worker_main(size_t slot) {
+	while (true) {
+		std::function< void(size_t) > task;
+		{
+			std::unique_lock< std::mutex > lock(mutex);
+			tasks_cv.wait(lock, [this](){ return quit || !tasks.empty(); });
+			if (quit) return; //(tasks that haven't started yet are dropped)
+			task = std::move(tasks.front());
+			tasks.pop_front();
+		}
+		task(slot);
+	}
+}
+
+void WorkerPool::submit(std::function< void(size_t slot) > const &task) {
+	if (workers.empty()) {
+		task(slots() - 1);
+		return;
+	}
+	{
+		std::unique_lock< std::mutex > lock(mutex);
+		tasks.emplace_back(task);
+	}
+	tasks_cv.notify_one();
+}
+
+void WorkerPool::parallel_for(size_t count, std::function< void(size_t index, size_t slot) > const &job) {
+	if (count == 0) return;
+
+	//jobs are claimed one at a time by whichever threads get to them; state is shared with helper tasks,
+	// which may only start running after everything has been claimed (and this function has returned):
+	struct Batch {
+		std::function< void(size_t, size_t) > job;
+		size_t count = 0;
+		std::atomic< size_t > next{0};
+		std::mutex mutex;
+		std::condition_variable done_cv;
+		size_t done = 0;
+		std::exception_ptr exception;
+
+		void run(size_t slot) {
+			while (true) {
+				size_t index = next.fetch_add(1);
+				if (index >= count) return;
+				std::exception_ptr caught;
+				try {
+					job(index, slot);
+				} catch (...) {
+					caught = std::current_exception();
+				}
+				std::unique_lock< std::mutex > lock(mutex);
+				if (caught && !exception) exception = caught;
+				done += 1;
+				if (done == count) done_cv.notify_all();
+			}
+		}
+	};
+	auto batch = std::make_shared< Batch >();
+	batch->job = job;
+	batch->count = count;
+
+	size_t helpers = std::min(workers.size(), count - 1);
+	if (helpers > 0) {
+		{
+			std::unique_lock< std::mutex > lock(mutex);
+			for (size_t i = 0; i < helpers; ++i) {
+				tasks.emplace_back([batch](size_t slot){ batch->run(slot); });
+			}
+		}
+		tasks_cv.notify_all();
+	}
+
+	//the calling thread works too (in the last slot):
+	batch->run(slots() - 1);
+
+	std::unique_lock< std::mutex > lock(batch->mutex);
+	batch->done_cv.wait(lock, [&](){ return batch->done == batch->count; });
+	if (batch->exception) std::rethrow_exception(batch->exception);
+}
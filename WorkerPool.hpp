@@ -0,0 +1,53 @@
+#pragma once
+
+/*
+ * WorkerPool -- a fixed set of threads for running CPU work off of (or
+ *  alongside) the main thread.
+ *
+ * parallel_for() spreads a batch of independent jobs over the workers and
+ *  the calling thread, and returns once they are all done.
+ * submit() queues a task to run in the background.
+ *
+ * Jobs must not make OpenGL calls (the context belongs to the main thread).
+ * Destroying the pool waits for running tasks, but drops queued ones.
+ *
+ */
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct WorkerPool {
+	//worker_count of zero runs everything on the calling thread:
+	WorkerPool(size_t worker_count = default_worker_count());
+	~WorkerPool();
+
+	//call job(index, slot) for every index in [0, count) (from one thread at a time, e.g. the main thread):
+	// slot is in [0, slots()) and no two jobs running at the same time share a slot,
+	// so it can be used to pick per-thread scratch data (e.g., shaping buffers).
+	// If any job throws, the first exception is rethrown here (after all jobs are done).
+	void parallel_for(size_t count, std::function< void(size_t index, size_t slot) > const &job);
+
+	//run task(slot) on some worker, eventually:
+	// (with no workers, runs it immediately)
+	void submit(std::function< void(size_t slot) > const &task);
+
+	//number of distinct slots passed to jobs (workers, plus the calling thread):
+	size_t slots() const { return workers.size() + 1; }
+
+	//hardware threads, less one for the main thread:
+	static size_t default_worker_count();
+
+	//-- internals --
+	std::vector< std::thread > workers;
+	std::mutex mutex;
+	std::condition_variable tasks_cv;
+	std::deque< std::function< void(size_t slot) > > tasks;
+	bool quit = false;
+
+	void worker_main(size_t slot);
+};
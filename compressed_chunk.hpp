@@ -0,0 +1,206 @@
+#pragma once
+
+/*
+ * compressed_chunk -- zlib-compressed chunks for v2 chunk files (see
+ *  read_write_chunk.hpp), for data that is copied out of the file anyway.
+ *
+ * A compressed chunk's payload (as stored, and as checksummed) is a
+ *  ChunkBlockTable, a ChunkBlock for each block, then the blocks: the data
+ *  is cut into block_size pieces that are deflated independently, so they
+ *  are deflated and inflated in parallel, each straight into its place.
+ * Chunks that wouldn't get any smaller are stored as plain chunks.
+ *
+ * Compressed chunks can't be used in place: read_chunk refuses them, and a
+ *  ChunkView only reads them if it is given inflate_chunk_copy (as Mesh and
+ *  Scene loaders do), which inflates each one into a copy. So they suit
+ *  data that is copied anyway, or that is read from a slow disk; data that
+ *  is best paged in lazily should stay plain.
+ *
+ * Usage:
+ *   write_chunk_file_header(&out, 8, ChunkFormat::ChunkChecksums | ChunkFormat::ChunkCompression);
+ *   write_compressed_chunk("glyf", glyphs, &out);
+ *   ...
+ *   read_chunk_file_header(in);
+ *   read_compressed_chunk(in, "glyf", &glyphs); //(plain chunks are read, too)
+ *   //or:
+ *   ChunkView view(path, inflate_chunk_copy);
+ *   Span< Story::Glyph const > glyphs = view.next< Story::Glyph >("glyf");
+ *
+ * The exporters in scenes/ write compressed .pnct and .scene files when run
+ *  with --compress.
+ *
+ */
+
+#include "read_write_chunk.hpp"
+#include "WorkerPool.hpp"
+
+#include <zlib.h>
+
+#include <functional>
+#include <memory>
+#include <mutex>
+
+//-- internals --
+struct ChunkBlockTable {
+	uint64_t size = 0; //of the data, once inflated
+	uint32_t block_size = 0; //of each block, once inflated (the last one may be smaller)
+	uint32_t block_count = 0;
+};
+static_assert(sizeof(ChunkBlockTable) == 16, "table is packed");
+
+struct ChunkBlock {
+	uint64_t offset = 0; //of the deflated block, from the start of the payload
+	uint64_t stored_size = 0;
+};
+static_assert(sizeof(ChunkBlock) == 16, "block is packed");
+
+//threads that blocks are deflated and inflated on:
+// (parallel_for is only for one thread at a time, so callers that find it busy do their blocks themselves)
+inline WorkerPool &chunk_pool() {
+	static WorkerPool pool;
+	return pool;
+}
+inline std::mutex &chunk_pool_mutex() {
+	static std::mutex mutex;
+	return mutex;
+}
+inline void chunk_parallel_for(size_t count, std::function< void(size_t index) > const &job) {
+	std::unique_lock< std::mutex > lock(chunk_pool_mutex(), std::try_to_lock);
+	if (count > 1 && lock.owns_lock()) {
+		chunk_pool().parallel_for(count, [&](size_t index, size_t) { job(index); });
+	} else {
+		for (size_t i = 0; i < count; ++i) job(i);
+	}
+}
+
+//deflate 'size' bytes into a compressed chunk payload:
+// (returns an empty vector if compressing wouldn't make the data any smaller)
+inline std::vector< char > deflate_chunk(char const *data, size_t size, uint32_t block_size = 256 << 10) {
+	ChunkBlockTable table;
+	table.size = size;
+	table.block_size = block_size;
+	table.block_count = uint32_t((size + block_size - 1) / block_size);
+
+	std::vector< std::vector< char > > blocks(table.block_count);
+	chunk_parallel_for(blocks.size(), [&](size_t i) {
+		size_t begin = i * size_t(block_size);
+		uLong in_size = uLong(std::min< size_t >(block_size, size - begin));
+		uLongf out_size = compressBound(in_size);
+		blocks[i].resize(out_size);
+		if (compress2(reinterpret_cast< Bytef * >(blocks[i].data()), &out_size, reinterpret_cast< Bytef const * >(data + begin), in_size, Z_DEFAULT_COMPRESSION) != Z_OK) {
+			throw std::runtime_error("Failed to compress chunk data.");
+		}
+		blocks[i].resize(out_size);
+	});
+
+	size_t payload_size = sizeof(table) + blocks.size() * sizeof(ChunkBlock);
+	for (auto const &block : blocks) payload_size += block.size();
+	if (payload_size >= size) return std::vector< char >();
+
+	std::vector< char > payload(sizeof(table) + blocks.size() * sizeof(ChunkBlock));
+	payload.reserve(payload_size);
+	std::memcpy(payload.data(), &table, sizeof(table));
+	for (size_t i = 0; i < blocks.size(); ++i) {
+		ChunkBlock entry;
+		entry.offset = payload.size();
+		entry.stored_size = blocks[i].size();
+		std::memcpy(payload.data() + sizeof(table) + i * sizeof(ChunkBlock), &entry, sizeof(entry));
+		payload.insert(payload.end(), blocks[i].begin(), blocks[i].end());
+	}
+	return payload;
+}
+
+//check a compressed chunk payload's block table, and return the size of its data once inflated:
+// (deflate never shrinks data by more than about 1032:1, so a damaged size can't ask for much more memory than that)
+inline uint64_t inflated_chunk_size(Span< char const > payload) {
+	ChunkBlockTable table;
+	if (payload.size() < sizeof(table)) {
+		throw std::runtime_error("Compressed chunk is missing its block table.");
+	}
+	std::memcpy(&table, payload.data(), sizeof(table));
+	if (table.block_size == 0 || table.block_count != (table.size + table.block_size - 1) / table.block_size
+		|| (payload.size() - sizeof(table)) / sizeof(ChunkBlock) < table.block_count
+		|| table.size / 1032 > payload.size()) {
+		throw std::runtime_error("Compressed chunk has a malformed block table.");
+	}
+	for (size_t i = 0; i < table.block_count; ++i) {
+		ChunkBlock block;
+		std::memcpy(&block, payload.data() + sizeof(table) + i * sizeof(ChunkBlock), sizeof(block));
+		if (block.offset > payload.size() || payload.size() - block.offset < block.stored_size) {
+			throw std::runtime_error("Compressed chunk has a block out of range.");
+		}
+	}
+	return table.size;
+}
+
+//inflate a compressed chunk payload (checked by inflated_chunk_size) into 'out', which has room for all of it:
+inline void inflate_chunk(Span< char const > payload, char *out) {
+	ChunkBlockTable table;
+	std::memcpy(&table, payload.data(), sizeof(table));
+	chunk_parallel_for(table.block_count, [&](size_t i) {
+		ChunkBlock block;
+		std::memcpy(&block, payload.data() + sizeof(table) + i * sizeof(ChunkBlock), sizeof(block));
+		size_t begin = i * size_t(table.block_size);
+		uLongf out_size = uLongf(std::min< uint64_t >(table.block_size, table.size - begin));
+		uLongf expected = out_size;
+		if (uncompress(reinterpret_cast< Bytef * >(out + begin), &out_size, reinterpret_cast< Bytef const * >(payload.data() + block.offset), uLong(block.stored_size)) != Z_OK
+			|| out_size != expected) {
+			throw std::runtime_error("Failed to inflate compressed chunk data.");
+		}
+	});
+}
+
+//--
+
+//helper function that writes a chunk compressed (or plain, if compressing doesn't help):
+// (the stream's file header must have ChunkFormat::ChunkCompression set, so readers know to expect compressed chunks)
+template< typename T, typename A >
+void write_compressed_chunk(std::string const &magic, std::vector< T, A > const &from, std::ostream *to_) {
+	assert(to_);
+	ChunkFormat format = chunk_format(*to_);
+	if (format.version == 1 || !(format.flags & ChunkFormat::ChunkCompression)) {
+		throw std::runtime_error("Compressed chunks need a file header with ChunkFormat::ChunkCompression set.");
+	}
+	char const *data = reinterpret_cast< char const * >(from.data());
+	uint64_t size = uint64_t(from.size()) * sizeof(T);
+	std::vector< char > deflated = deflate_chunk(data, size_t(size));
+	if (deflated.empty()) {
+		write_chunk_data(magic, data, size, 0, to_);
+	} else {
+		write_chunk_data(magic, deflated.data(), deflated.size(), ChunkFormat::ChunkCompression, to_);
+	}
+}
+
+//helper function that reads a chunk, compressed or not; compressed chunks are inflated in parallel, straight into the vector:
+// (as with read_chunk, a chunk_vector isn't zeroed before it is inflated into)
+template< typename T, typename A >
+void read_compressed_chunk(std::istream &from, std::string const &magic, std::vector< T, A > *to_) {
+	assert(to_);
+	auto &to = *to_;
+
+	ChunkStreamHeader header = read_chunk_header(from, magic);
+	if (!header.compressed) {
+		read_chunk_payload(from, header, &to);
+		return;
+	}
+
+	chunk_vector< char > stored;
+	read_chunk_payload(from, header, &stored);
+	Span< char const > payload(stored.data(), stored.size());
+	uint64_t size = inflated_chunk_size(payload);
+	if (size % sizeof(T) != 0) {
+		throw std::runtime_error("Size of chunk not divisible by element size");
+	}
+	to.clear();
+	to.resize(size_t(size / sizeof(T)));
+	inflate_chunk(payload, reinterpret_cast< char * >(to.data()));
+}
+
+//helper function for ChunkView (a ChunkInflater) that inflates a compressed chunk payload into new storage:
+inline Span< char const > inflate_chunk_copy(Span< char const > payload, std::unique_ptr< char[] > *storage) {
+	assert(storage);
+	uint64_t size = inflated_chunk_size(payload);
+	storage->reset(new char[size_t(size)]); //(left uninitialized, since it is inflated over)
+	inflate_chunk(payload, storage->get());
+	return Span< char const >(storage->get(), size_t(size));
+}
@@ -16,6 +16,9 @@
 //for screenshots:
 #include "load_save_png.hpp"
 
+//for marking the end of each frame's streamed geometry:
+#include "StreamBuffer.hpp"
+
 //Includes for libSDL:
 #include <SDL.h>
 
@@ -185,6 +188,9 @@ int main(int argc, char **argv) {
 		{ //(3) call the current mode's "draw" function to produce output:
 		
 			Mode::current->draw(drawable_size);
+
+			//streamed geometry for this frame may be reused once the GPU is done with it:
+			StreamBuffer::shared().end_frame();
 		}
 
 		//Wait until the recently-drawn frame is shown before doing it all again:
@@ -1,157 +1,920 @@
 #include "read_write_chunk.hpp"
+#include "compressed_chunk.hpp"
 #include <iostream>
 //#include "../nest-libs/windows/glm/include/glm/glm.hpp"
 #include <glm/glm.hpp>
 #include <algorithm>
+#include <cstring>
+#include <atomic>
 #include <fstream>
 #include <set>
-#include "PlayMode.hpp"
+#include <sstream>
+#include "Story.hpp"
+#include "ChunkView.hpp"
+#include "WorkerPool.hpp"
 #include "data_path.hpp"
 #include <filesystem>
+#include <map>
+#include <memory>
+#include <unordered_map>
 
-int main(int argc, char** argv) {
-    // Array of state names
-    std::vector<std::string> state_names = {
-        "start",
-        "ask_age_kairos"
-    };
+//#include "../nest-libs/windows/harfbuzz/include/hb.h"
+//#include "../nest-libs/windows/harfbuzz/include/hb-ft.h"
+//#include "../nest-libs/windows/freetype/include/freetype/freetype.h"
+#include <hb.h>
+#include <hb-ft.h>
+#include <freetype/freetype.h>
 
-    // Generate states
-    //for (auto const& state_name : state_names) {
-    for (const auto& file : std::filesystem::directory_iterator(data_path("states"))) {
-        std::string state_name = file.path().filename().string();
-        state_name = state_name.substr(0, state_name.size() - 4);
-        std::vector<char> string_data;
-        std::vector<PlayMode::Line> lines;
-
-        // Read text lines from state file
-        std::ifstream ifile(data_path("states/" + state_name + ".txt"), std::ios::binary);
-        std::string line_str;
-        while (std::getline(ifile, line_str)) {
-            // Skip empty lines
-            if (line_str.size() <= 1) {
-                continue;
-            }
+// A state as read from its text file (and shaped, when baking), before transitions are compiled
+// (chunk_vectors, so reading a cached state doesn't zero them before inflating into them)
+struct ParsedState {
+    std::string name;
+    chunk_vector<char> string_data;
+    chunk_vector<Story::Line> lines; // (glyph ranges index into glyphs)
+    chunk_vector<Story::Transition> transitions;
+    chunk_vector<Story::Condition> conditions;
+    chunk_vector<Story::Glyph> glyphs;
+    int32_t timeline_date = 0;
+    std::vector<Story::Edge> edges;
+};
+
+// Per-thread HarfBuzz shaping state (faces and fonts can't be shared between threads)
+struct Shaper {
+    FT_Face ft_face = nullptr;
+    hb_font_t* hb_font = nullptr;
+    hb_buffer_t* hb_buffer = nullptr;
+};
+
+// Runs are incremental: pipeline-cache/manifest records the content hash of every input, and each state's parsed
+// (and shaped) form is cached in pipeline-cache/<state>, so only the state files that changed are compiled again.
+// If nothing changed at all, the bundle isn't touched; otherwise it is only rewritten if its contents change.
+// Bump PipelineVersion whenever parsing or shaping changes, so old caches aren't used.
+enum : uint32_t {
+    PipelineVersion = 1
+};
+struct Manifest {
+    uint32_t pipeline_version = 0;
+    uint32_t story_version = 0;
+    uint32_t bake = 0;
+    uint32_t font_size = 0;
+    uint64_t font_hash = 0;
+    uint64_t speakers_hash = 0;
+    uint64_t output_hash = 0; // of the bundle written last time
+};
+struct ManifestEntry {
+    Story::Name name; // of the state, in the manifest's "strn"
+    uint64_t hash = 0; // of the state file
+};
+struct CachedState {
+    int32_t timeline_date = 0;
+    uint32_t padding = 0;
+    uint64_t source_hash = 0; // of the state file it was compiled from (checked too, in case a run stopped before writing the manifest)
+};
+
+// Read a state file; throws std::runtime_error if it is malformed
+static ParsedState parseState(const std::string& state_name, const std::string& path) {
+    chunk_vector<char> string_data;
+    chunk_vector<Story::Line> lines;
+
+    // Read text lines from state file
+    std::ifstream ifile(path, std::ios::binary);
+    if (!ifile) {
+        throw std::runtime_error("Couldn't read the state file '" + path + "'");
+    }
+    std::string line_str;
+    while (std::getline(ifile, line_str)) {
+        // Files may have Windows line endings
+        if (!line_str.empty() && line_str.back() == '\r') {
+            line_str.pop_back();
+        }
+
+        // Skip empty lines
+        if (line_str.size() <= 1) {
+            continue;
+        }
+
+        // Break at the footer
+        if (line_str[0] == '-') {
+            break;
+        }
 
-            // Break at the footer
-            if (line_str[0] == '-') {
-                break;
+        // Read line into string data and set line to point to it
+        Story::Line line;
+        line.text_start = string_data.size();
+        for (size_t i = 0; i < line_str.size(); i++) {
+            string_data.push_back(line_str[i]);
+        }
+        line.text_end = string_data.size();
+
+        // Detect if the line was spoken
+        if (line_str[0] == '*') {
+            size_t colon_index = line_str.find(':');
+            line.spoken = true;
+            line.speaker_start = line.text_start + 1;
+            line.speaker_end = line.text_start + colon_index;
+            line.text_start += colon_index + 2;
+        }
+
+        lines.push_back(line);
+    }
+
+    // Read state footer for transitions and conditions
+    chunk_vector<Story::Transition> transitions;
+    chunk_vector<Story::Condition> conditions;
+    int32_t timeline_date = 0;
+    while (std::getline(ifile, line_str)) {
+        if (!line_str.empty() && line_str.back() == '\r') {
+            line_str.pop_back();
+        }
+        if (line_str.size() <= 1) {
+            continue;
+        }
+
+        // "@year" means that entering this state starts a new timeline in that year
+        if (line_str[0] == '@') {
+            size_t digits = line_str.find_first_not_of("0123456789", 1);
+            if (digits != std::string::npos || line_str.size() > 6) {
+                throw std::runtime_error("In state '" + state_name + "': timelines must be written as @year, not '" + line_str + "'");
             }
+            timeline_date = std::stoi(line_str.substr(1));
+            continue;
+        }
 
-            // Read line into string data and set line to point to it
-            PlayMode::Line line;
-            line.text_start = string_data.size();
-            for (size_t i = 0; i < line_str.size(); i++) {
+        // Construct transition
+        Story::Transition transition;
+        size_t l_index = line_str.find('[');
+        size_t r_index = line_str.find("] ");
+        if (l_index < r_index && r_index < line_str.size()) {
+            transition.trigger_start = string_data.size();
+            for (size_t i = l_index + 1; i < r_index; i++) {
                 string_data.push_back(line_str[i]);
             }
-            line.text_end = string_data.size();
+            transition.trigger_end = string_data.size();
+        } else {
+            throw std::runtime_error("In state '" + state_name + "': transitions must start with a [name in square brackets] followed by a space");
+        }
+
+        // Helper function to read all conditions between the given string indices and store them in the conditions vector
+        auto readConditions = [&](size_t start, size_t end) {
+            size_t condition_start_index = start;
+            while (condition_start_index < end) {
+                Story::Condition condition;
+
+                // If condition starts with tilde, negate it
+                if (line_str[condition_start_index] == '~') {
+                    condition.negated = true;
+                    condition_start_index++;
+                } else {
+                    condition.negated = false;
+                }
 
-            // Detect if the line was spoken
-            if (line_str[0] == '*') {
-                size_t colon_index = line_str.find(':');
-                line.spoken = true;
-                line.speaker_start = line.text_start + 1;
-                line.speaker_end = line.text_start + colon_index;
-                line.text_start += colon_index + 2;
+                // Read condition name
+                condition.name_start = string_data.size();
+                size_t condition_end_index = std::min(line_str.find(' ', condition_start_index), line_str.size());
+                for (size_t i = condition_start_index; i < condition_end_index; i ++) {
+                    string_data.push_back(line_str[i]);
+                }
+                condition.name_end = string_data.size();
+
+                // Store condition in conditions vector
+                conditions.push_back(condition);
+
+                // Prepare to read next condition
+                condition_start_index = condition_end_index + 1;
             }
+        };
+
+        // Read pre- and post-conditions for the transition
+        size_t arrow_index = line_str.find(" -> ", r_index + 1);
+        if (arrow_index < line_str.size()) {
+            // Read preconditions
+            transition.preconditions_start = conditions.size();
+            readConditions(r_index + 2, arrow_index);
+            transition.preconditions_end = conditions.size();
 
-            lines.push_back(line);
+            // Read postconditions
+            transition.postconditions_start = conditions.size();
+            readConditions(arrow_index + 4, line_str.size());
+            transition.postconditions_end = conditions.size();
+        } else {
+            // Read postconditions
+            transition.postconditions_start = conditions.size();
+            readConditions(r_index + 2, line_str.size());
+            transition.postconditions_end = conditions.size();
         }
 
-        // Read state footer for transitions and conditions
-        std::vector<PlayMode::Transition> transitions;
-        std::vector<PlayMode::Condition> conditions;
-        while (std::getline(ifile, line_str)) {
-            if (line_str.size() <= 1) {
+        // Store transition in transitions vector
+        transitions.push_back(transition);
+    }
+
+    ParsedState state;
+    state.name = state_name;
+    state.string_data = std::move(string_data);
+    state.lines = std::move(lines);
+    state.transitions = std::move(transitions);
+    state.conditions = std::move(conditions);
+    state.timeline_date = timeline_date;
+    return state;
+}
+
+// Open the font at the game's size for shaping; returns false if it can't be loaded
+static bool openShaper(FT_Library ft_library, const std::string& font_path, uint32_t font_size, Shaper* shaper) {
+    if (FT_New_Face(ft_library, font_path.c_str(), 0, &shaper->ft_face)
+        || FT_Set_Char_Size(shaper->ft_face, font_size * 64, font_size * 64, 0, 0)) {
+        return false;
+    }
+    shaper->hb_font = hb_ft_font_create(shaper->ft_face, NULL);
+    shaper->hb_buffer = hb_buffer_create();
+    return true;
+}
+
+static void closeShaper(Shaper* shaper) {
+    if (shaper->hb_buffer) {
+        hb_buffer_destroy(shaper->hb_buffer);
+        hb_font_destroy(shaper->hb_font);
+    }
+    if (shaper->ft_face) {
+        FT_Done_Face(shaper->ft_face);
+    }
+    *shaper = Shaper();
+}
+
+// The FreeType library and a Shaper per thread, all released when it goes out of scope (even if shaping throws)
+struct Shapers {
+    FT_Library ft_library = nullptr;
+    std::vector<Shaper> slots;
+
+    Shapers() = default;
+    Shapers(const Shapers&) = delete;
+    Shapers& operator=(const Shapers&) = delete;
+    ~Shapers() {
+        for (Shaper& shaper : slots) {
+            closeShaper(&shaper);
+        }
+        if (ft_library) {
+            FT_Done_FreeType(ft_library);
+        }
+    }
+
+    // Open the font at the game's size for each of 'count' threads; returns false if FreeType or the font can't be loaded
+    bool open(const std::string& font_path, uint32_t font_size, size_t count) {
+        if (FT_Init_FreeType(&ft_library)) {
+            ft_library = nullptr;
+            return false;
+        }
+        slots.resize(count);
+        for (Shaper& shaper : slots) {
+            if (!openShaper(ft_library, font_path, font_size, &shaper)) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// Shape a line's text with HarfBuzz, exactly as PlayMode::shapeText would, so the result is the same
+static void shapeText(const std::string& text, Shaper& shaper, chunk_vector<Story::Glyph>* glyphs) {
+    hb_buffer_clear_contents(shaper.hb_buffer);
+    hb_buffer_add_utf8(shaper.hb_buffer, text.c_str(), (int)text.size(), 0, (int)text.size());
+    hb_buffer_guess_segment_properties(shaper.hb_buffer);
+    hb_shape(shaper.hb_font, shaper.hb_buffer, NULL, 0);
+
+    unsigned int len = hb_buffer_get_length(shaper.hb_buffer);
+    hb_glyph_info_t* info = hb_buffer_get_glyph_infos(shaper.hb_buffer, NULL);
+    hb_glyph_position_t* pos = hb_buffer_get_glyph_positions(shaper.hb_buffer, NULL);
+    for (unsigned int i = 0; i < len; i++) {
+        Story::Glyph glyph;
+        glyph.glyph = info[i].codepoint;
+        glyph.cluster = info[i].cluster;
+        glyph.x_advance = pos[i].x_advance;
+        glyph.y_advance = pos[i].y_advance;
+        glyph.x_offset = pos[i].x_offset;
+        glyph.y_offset = pos[i].y_offset;
+        glyphs->push_back(glyph);
+    }
+}
+
+// Shape every line of a state (as Story::lineText will show it)
+static void shapeState(ParsedState* state, Shaper& shaper) {
+    for (Story::Line& line : state->lines) {
+        std::string text;
+        if (line.spoken) {
+            text = std::string(state->string_data.begin() + line.speaker_start, state->string_data.begin() + line.speaker_end) + ": ";
+        }
+        text.append(state->string_data.begin() + line.text_start, state->string_data.begin() + line.text_end);
+
+        line.glyphs_start = state->glyphs.size();
+        shapeText(text, shaper, &state->glyphs);
+        line.glyphs_end = state->glyphs.size();
+    }
+}
+
+// Load the bundle the way the game does and check that every line's baked glyphs are what shaping the text
+// the game shows (Story::lineText) would give, so drawing baked text looks the same as drawing shaped text;
+// returns the exit code
+static int checkBakedText(const std::string& output_path, const std::string& font_path, uint32_t font_size) {
+    try {
+        Story story(output_path);
+        story.validate();
+        if (!story.baked(font_path, font_size)) {
+            std::cerr << "Story text in '" << output_path << "' wasn't baked with '" << font_path << "' at size " << font_size << "." << std::endl;
+            return 1;
+        }
+        Shapers shapers;
+        if (!shapers.open(font_path, font_size, 1)) {
+            std::cerr << "Couldn't load the font '" << font_path << "' to check baked text with" << std::endl;
+            return 1;
+        }
+        size_t line_count = 0;
+        size_t mismatches = 0;
+        chunk_vector<Story::Glyph> shaped;
+        for (const Story::State& state : story.states) {
+            for (size_t i = 0; i < state.lines.size(); i++) {
+                std::string text = story.lineText(state, i);
+                shaped.clear();
+                shapeText(text, shapers.slots[0], &shaped);
+                Span<const Story::Glyph> baked = story.glyphs.slice(state.lines[i].glyphs_start, state.lines[i].glyphs_end);
+                bool same = (baked.size() == shaped.size());
+                for (size_t g = 0; same && g < shaped.size(); g++) {
+                    same = std::memcmp(&baked[g], &shaped[g], sizeof(Story::Glyph)) == 0;
+                }
+                if (!same) {
+                    if (mismatches < 10) {
+                        std::cerr << "  baked text differs in state '" << state.name << "', line " << i << ": \"" << text << "\"" << std::endl;
+                    }
+                    mismatches++;
+                }
+                line_count++;
+            }
+        }
+        if (mismatches > 0) {
+            std::cerr << "Baked text doesn't match shaped text in " << mismatches << " of " << line_count << " lines." << std::endl;
+            return 1;
+        }
+        std::cout << "Baked text matches shaped text in all " << line_count << " lines." << std::endl;
+    } catch (const std::exception& e) {
+        std::cerr << "Couldn't check baked text: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Write a file next to where it goes and then rename it into place, so a failed write (say, a full disk)
+// never leaves a truncated file behind; throws std::runtime_error if it fails
+static void replaceFile(const std::string& path, const std::string& data) {
+    const std::string temp_path = path + ".tmp";
+    std::ofstream ofile(temp_path, std::ios::binary);
+    ofile.write(data.data(), data.size());
+    ofile.close();
+    if (!ofile) {
+        std::error_code error;
+        std::filesystem::remove(temp_path, error);
+        throw std::runtime_error("Couldn't write '" + path + "'.");
+    }
+    std::filesystem::rename(temp_path, path);
+}
+
+// Cached states are checksummed, compressed chunk files (baked glyphs compress well);
+// they are copied into a ParsedState anyway, so they are inflated straight into its vectors
+static void writeCachedState(const ParsedState& state, uint64_t source_hash, const std::string& path) {
+    CachedState cached;
+    cached.timeline_date = state.timeline_date;
+    cached.source_hash = source_hash;
+    std::ostringstream file;
+    write_chunk_file_header(&file, 8, ChunkFormat::ChunkChecksums | ChunkFormat::ChunkCompression);
+    write_chunk("psta", std::vector<CachedState>{ cached }, &file);
+    write_compressed_chunk("line", state.lines, &file);
+    write_compressed_chunk("tran", state.transitions, &file);
+    write_compressed_chunk("cond", state.conditions, &file);
+    write_compressed_chunk("glyf", state.glyphs, &file);
+    write_compressed_chunk("strn", state.string_data, &file);
+    replaceFile(path, file.str());
+}
+
+static ParsedState readCachedState(const std::string& state_name, uint64_t source_hash, const std::string& path) {
+    std::ifstream ifile(path, std::ios::binary);
+    if (!ifile) {
+        throw std::runtime_error("Cached state '" + path + "' is missing.");
+    }
+    read_chunk_file_header(ifile);
+    std::vector<CachedState> cached;
+    read_chunk(ifile, "psta", &cached);
+    if (cached.size() != 1 || cached[0].source_hash != source_hash) {
+        throw std::runtime_error("Cached state '" + path + "' is out of date.");
+    }
+
+    ParsedState state;
+    state.name = state_name;
+    read_compressed_chunk(ifile, "line", &state.lines);
+    read_compressed_chunk(ifile, "tran", &state.transitions);
+    read_compressed_chunk(ifile, "cond", &state.conditions);
+    read_compressed_chunk(ifile, "glyf", &state.glyphs);
+    read_compressed_chunk(ifile, "strn", &state.string_data);
+    state.timeline_date = cached[0].timeline_date;
+    return state;
+}
+
+int main(int argc, char** argv) {
+    // Line text is shaped here, with the game's font and size, so the game only has to break it into lines
+    // (the game checks the font and size it was baked with, and shapes it itself if they don't match)
+    bool bake = true;
+    bool check_bake = false;
+    bool force = false;
+    size_t jobs = WorkerPool::default_worker_count() + 1;
+    bool usage = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--no-bake") {
+            bake = false;
+        } else if (arg == "--check-bake") {
+            check_bake = true;
+        } else if (arg == "--force") {
+            force = true;
+        } else if (arg == "--jobs" && i + 1 < argc && std::atoi(argv[i + 1]) > 0) {
+            jobs = (size_t)std::atoi(argv[++i]);
+        } else {
+            usage = true;
+        }
+    }
+    if (usage || (check_bake && !bake)) {
+        std::cerr << "Usage: " << argv[0] << " [--no-bake | --check-bake] [--force] [--jobs N]" << std::endl;
+        std::cerr << "  --no-bake leaves text unshaped, --check-bake checks the baked text against the text the game shows," << std::endl;
+        std::cerr << "  --force ignores the pipeline cache, and --jobs sets how many threads compile states." << std::endl;
+        exit(1);
+    }
+    const std::string font_path = data_path("Roboto/Roboto-Black.ttf");
+    const uint32_t font_size = 24; // (PlayMode::font_size)
+    const std::string output_path = data_path("assets/story");
+    const std::string cache_path = data_path("pipeline-cache");
+    WorkerPool pool(jobs - 1);
+
+    // State ids are assigned in name order, so that the output doesn't depend on directory order
+    // (only .txt files are states; editor backups, .DS_Store and subdirectories are skipped)
+    std::vector<std::string> state_names;
+    try {
+        for (const auto& file : std::filesystem::directory_iterator(data_path("states"))) {
+            if (!file.is_regular_file() || file.path().extension() != ".txt") {
                 continue;
             }
+            state_names.push_back(file.path().stem().string());
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Couldn't list the state files: " << e.what() << std::endl;
+        exit(1);
+    }
+    std::sort(state_names.begin(), state_names.end());
+    auto statePath = [&](const std::string& state_name) {
+        return data_path("states/" + state_name + ".txt");
+    };
 
-            // Construct transition
-            PlayMode::Transition transition;
-            size_t l_index = line_str.find('[');
-            size_t r_index = line_str.find("] ");
-            if (l_index < r_index && r_index < line_str.size()) {
-                transition.trigger_start = string_data.size();
-                for (size_t i = l_index + 1; i < r_index; i++) {
-                    string_data.push_back(line_str[i]);
+    // Hash every input, and compare with the manifest from the last run
+    Manifest manifest;
+    manifest.pipeline_version = PipelineVersion;
+    manifest.story_version = Story::Version;
+    if (bake) {
+        manifest.bake = 1;
+        manifest.font_size = font_size;
+        try {
+            manifest.font_hash = Story::hashFile(font_path);
+        } catch (const std::exception& e) {
+            std::cerr << "Couldn't read the font '" << font_path << "' to shape text with (use --no-bake to leave text unshaped): " << e.what() << std::endl;
+            exit(1);
+        }
+    }
+    std::vector<uint64_t> state_hashes(state_names.size());
+    try {
+        if (std::filesystem::exists(data_path("speakers.txt"))) {
+            manifest.speakers_hash = Story::hashFile(data_path("speakers.txt"));
+        }
+        pool.parallel_for(state_names.size(), [&](size_t i, size_t) {
+            state_hashes[i] = Story::hashFile(statePath(state_names[i]));
+        });
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        exit(1);
+    }
+
+    std::vector<bool> cached(state_names.size(), false); // whether the state's cache is up to date
+    bool up_to_date = false;
+    if (!force && std::filesystem::exists(cache_path + "/manifest")) {
+        try {
+            ChunkView file(cache_path + "/manifest");
+            Span<const Manifest> old_manifest = file.next<Manifest>("pman");
+            Span<const ManifestEntry> old_entries = file.next<ManifestEntry>("mfil");
+            Span<const char> old_strings = file.next<char>("strn");
+            if (old_manifest.size() == 1 && old_manifest[0].pipeline_version == manifest.pipeline_version && old_manifest[0].story_version == manifest.story_version
+                && old_manifest[0].bake == manifest.bake && old_manifest[0].font_size == manifest.font_size && old_manifest[0].font_hash == manifest.font_hash) {
+                std::unordered_map<std::string, uint64_t> old_hashes;
+                for (const ManifestEntry& entry : old_entries) {
+                    if (entry.name.start <= entry.name.end && entry.name.end <= old_strings.size()) {
+                        old_hashes[std::string(old_strings.data() + entry.name.start, entry.name.end - entry.name.start)] = entry.hash;
+                    }
+                }
+                bool all_cached = (old_hashes.size() == state_names.size());
+                for (size_t i = 0; i < state_names.size(); i++) {
+                    auto found = old_hashes.find(state_names[i]);
+                    cached[i] = (found != old_hashes.end() && found->second == state_hashes[i]);
+                    all_cached = all_cached && cached[i];
+                }
+                up_to_date = all_cached && old_manifest[0].speakers_hash == manifest.speakers_hash
+                    && std::filesystem::exists(output_path) && Story::hashFile(output_path) == old_manifest[0].output_hash;
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "WARNING: ignoring the pipeline cache (" << e.what() << ")." << std::endl;
+            std::fill(cached.begin(), cached.end(), false);
+        }
+    }
+    if (up_to_date) {
+        std::cout << "Story is up to date (" << state_names.size() << " states)." << std::endl;
+        return check_bake ? checkBakedText(output_path, font_path, font_size) : 0;
+    }
+
+    // Parse (and shape) the states that changed, and read the rest from the cache; states are independent, so this runs in parallel
+    // (shapers are only opened if there's text to shape, and are released once compiling is done)
+    auto shapers = std::make_unique<Shapers>();
+    if (bake && std::find(cached.begin(), cached.end(), false) != cached.end()) {
+        if (!shapers->open(font_path, font_size, pool.slots())) {
+            std::cerr << "Couldn't load the font '" << font_path << "' to shape text with (use --no-bake to leave text unshaped)" << std::endl;
+            exit(1);
+        }
+    }
+    std::filesystem::create_directories(cache_path);
+    std::vector<ParsedState> parsed_states(state_names.size());
+    std::atomic<size_t> compiled_count(0);
+    try {
+        pool.parallel_for(state_names.size(), [&](size_t i, size_t slot) {
+            const std::string state_cache_path = cache_path + "/" + state_names[i];
+            if (cached[i]) {
+                try {
+                    parsed_states[i] = readCachedState(state_names[i], state_hashes[i], state_cache_path);
+                    return;
+                } catch (const std::exception&) {
+                    // (a missing or damaged cache entry just means compiling the state again)
                 }
-                transition.trigger_end = string_data.size();
+            }
+            parsed_states[i] = parseState(state_names[i], statePath(state_names[i]));
+            if (bake) {
+                shapeState(&parsed_states[i], shapers->slots[slot]);
+            }
+            writeCachedState(parsed_states[i], state_hashes[i], state_cache_path);
+            compiled_count++;
+        });
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        exit(1);
+    }
+    shapers.reset();
+    std::cout << "Compiled " << compiled_count << " of " << state_names.size() << " states (the rest were unchanged) on " << pool.slots() << (pool.slots() == 1 ? " thread." : " threads.") << std::endl;
+
+    // Drop cached states whose state files are gone
+    std::set<std::string> state_name_set(state_names.begin(), state_names.end());
+    std::vector<std::filesystem::path> stale;
+    for (const auto& file : std::filesystem::directory_iterator(cache_path)) {
+        std::string name = file.path().filename().string();
+        if (name != "manifest" && state_name_set.count(name) == 0) {
+            stale.push_back(file.path());
+        }
+    }
+    for (const std::filesystem::path& path : stale) {
+        std::error_code error; // (a cache entry that can't be removed is just left behind)
+        std::filesystem::remove(path, error);
+    }
+
+    // Compile transitions: states get dense ids (their index in state_names), trigger phrases are interned,
+    // and each state gets a table of (trigger id, target state id) sorted by trigger
+    std::unordered_map<std::string, uint32_t> state_ids;
+    for (size_t i = 0; i < state_names.size(); i++) {
+        state_ids[state_names[i]] = (uint32_t)i;
+    }
+
+    std::vector<char> story_strings;
+    std::vector<Story::Name> state_name_table;
+    std::vector<Story::Name> trigger_name_table;
+    std::unordered_map<std::string, uint32_t> trigger_ids;
+    auto addName = [&](const std::string& name, std::vector<Story::Name>* table) {
+        Story::Name entry;
+        entry.start = story_strings.size();
+        story_strings.insert(story_strings.end(), name.begin(), name.end());
+        entry.end = story_strings.size();
+        table->push_back(entry);
+    };
+    for (auto const& state_name : state_names) {
+        addName(state_name, &state_name_table);
+    }
+
+    // Every other condition name is a world flag; a set of conditions compiles to one FlagTerm per bitset word
+    std::vector<Story::Name> flag_name_table;
+    std::unordered_map<std::string, uint32_t> flag_ids;
+    std::vector<Story::FlagTerm> story_flag_terms;
+    auto compileTerms = [&](const ParsedState& state, size_t conditions_start, size_t conditions_end, uint32_t* terms_start, uint32_t* terms_end) {
+        std::map<uint64_t, Story::FlagTerm> terms;
+        for (size_t i = conditions_start; i < conditions_end; i++) {
+            const Story::Condition& condition = state.conditions[i];
+            std::string flag_name(state.string_data.begin() + condition.name_start, state.string_data.begin() + condition.name_end);
+            auto inserted = flag_ids.emplace(flag_name, (uint32_t)flag_name_table.size());
+            if (inserted.second) {
+                addName(flag_name, &flag_name_table);
+            }
+            uint32_t flag = inserted.first->second;
+
+            Story::FlagTerm& term = terms[flag / 64];
+            term.word = flag / 64;
+            uint64_t bit = uint64_t(1) << (flag % 64);
+            if ((term.mask & bit) && ((term.value & bit) != 0) == condition.negated) {
+                std::cerr << "WARNING: a transition in state '" << state.name << "' uses both '" << flag_name << "' and '~" << flag_name << "'; the last one wins." << std::endl;
+            }
+            term.mask |= bit;
+            if (condition.negated) {
+                term.value &= ~bit;
             } else {
-                std::cerr << "State transitions must start with a [name in square brackets] followed by a space" << std::endl;
-                exit(1);
+                term.value |= bit;
             }
+        }
+        *terms_start = (uint32_t)story_flag_terms.size();
+        for (auto const& entry : terms) {
+            story_flag_terms.push_back(entry.second);
+        }
+        *terms_end = (uint32_t)story_flag_terms.size();
+    };
 
-            // Helper function to read all conditions between the given string indices and store them in the conditions vector
-            auto readConditions = [&](size_t start, size_t end) {
-                size_t condition_start_index = start;
-                while (condition_start_index < end) {
-                    PlayMode::Condition condition;
+    for (ParsedState& state : parsed_states) {
+        auto text = [&](size_t start, size_t end) {
+            return std::string(state.string_data.begin() + start, state.string_data.begin() + end);
+        };
 
-                    // If condition starts with tilde, negate it
-                    if (line_str[condition_start_index] == '~') {
-                        condition.negated = true;
-                        condition_start_index++;
-                    } else {
-                        condition.negated = false;
-                    }
+        std::vector<Story::Edge> edges;
+        for (const Story::Transition& transition : state.transitions) {
+            std::string trigger = text(transition.trigger_start, transition.trigger_end);
+            if (transition.postconditions_start == transition.postconditions_end) {
+                std::cerr << "WARNING: [" << trigger << "] in state '" << state.name << "' doesn't lead anywhere; skipping it." << std::endl;
+                continue;
+            }
+            const Story::Condition& target_condition = state.conditions[transition.postconditions_start];
+            std::string target = text(target_condition.name_start, target_condition.name_end);
+            auto found = state_ids.find(target);
+            if (found == state_ids.end()) {
+                std::cerr << "WARNING: [" << trigger << "] in state '" << state.name << "' leads to unknown state '" << target << "'; skipping it." << std::endl;
+                continue;
+            }
 
-                    // Read condition name
-                    condition.name_start = string_data.size();
-                    size_t condition_end_index = std::min(line_str.find(' ', condition_start_index), line_str.size() - 1);
-                    for (size_t i = condition_start_index; i < condition_end_index; i ++) {
-                        string_data.push_back(line_str[i]);
-                    }
-                    condition.name_end = string_data.size();
+            auto inserted = trigger_ids.emplace(trigger, (uint32_t)trigger_name_table.size());
+            if (inserted.second) {
+                addName(trigger, &trigger_name_table);
+            }
 
-                    // Store condition in conditions vector
-                    conditions.push_back(condition);
+            Story::Edge edge;
+            edge.trigger = inserted.first->second;
+            edge.target = found->second;
+            compileTerms(state, transition.preconditions_start, transition.preconditions_end, &edge.guards_start, &edge.guards_end);
+            compileTerms(state, transition.postconditions_start + 1, transition.postconditions_end, &edge.effects_start, &edge.effects_end);
+            edges.push_back(edge);
+        }
 
-                    // Prepare to read next condition
-                    condition_start_index = condition_end_index + 1;
+        // Sorted by trigger, so the game can binary search; the first of several transitions with the same trigger
+        // whose preconditions hold wins, so anything after one without preconditions is never used
+        std::stable_sort(edges.begin(), edges.end(), [](const Story::Edge& a, const Story::Edge& b) {
+            return a.trigger < b.trigger;
+        });
+        std::vector<Story::Edge> used_edges;
+        for (const Story::Edge& edge : edges) {
+            if (!used_edges.empty() && used_edges.back().trigger == edge.trigger && used_edges.back().guards_start == used_edges.back().guards_end) {
+                const Story::Name& name = trigger_name_table[edge.trigger];
+                std::cerr << "WARNING: state '" << state.name << "' has a transition for [" << std::string(story_strings.begin() + name.start, story_strings.begin() + name.end) << "] that always wins over later ones; only the first is used." << std::endl;
+                continue;
+            }
+            used_edges.push_back(edge);
+        }
+        state.edges = std::move(used_edges);
+    }
+
+    auto start = state_ids.find("start");
+    if (start == state_ids.end()) {
+        std::cerr << "The story needs a 'start' state" << std::endl;
+        exit(1);
+    }
+
+    // Check the whole graph: depth of each state is the fewest transitions it takes to get there from start
+    std::vector<uint32_t> depths(parsed_states.size(), Story::UnreachableDepth);
+    std::vector<uint32_t> frontier = { start->second };
+    depths[start->second] = 0;
+    for (uint32_t depth = 1; !frontier.empty(); depth++) {
+        std::vector<uint32_t> next;
+        for (uint32_t from : frontier) {
+            for (const Story::Edge& edge : parsed_states[from].edges) {
+                if (depths[edge.target] == Story::UnreachableDepth) {
+                    depths[edge.target] = depth;
+                    next.push_back(edge.target);
                 }
-            };
-
-            // Read pre- and post-conditions for the transition
-            size_t arrow_index = line_str.find(" -> ", r_index + 1);
-            if (arrow_index < line_str.size()) {
-                // Read preconditions
-                transition.preconditions_start = conditions.size();
-                readConditions(r_index + 2, arrow_index);
-                transition.preconditions_end = conditions.size();
-
-                // Read postconditions
-                transition.postconditions_start = conditions.size();
-                readConditions(arrow_index + 4, line_str.size());
-                transition.postconditions_end = conditions.size();
-            } else {
-                // Read postconditions
-                transition.postconditions_start = conditions.size();
-                readConditions(r_index + 2, line_str.size());
-                transition.postconditions_end = conditions.size();
             }
+        }
+        frontier = std::move(next);
+    }
 
-            // Store transition in transitions vector
-            transitions.push_back(transition);
+    std::vector<std::string> dead_ends;
+    for (size_t i = 0; i < parsed_states.size(); i++) {
+        if (depths[i] == Story::UnreachableDepth) {
+            std::cerr << "WARNING: state '" << parsed_states[i].name << "' can't be reached from 'start'." << std::endl;
+        }
+        if (parsed_states[i].edges.empty()) {
+            dead_ends.push_back(parsed_states[i].name);
+        }
+    }
+    std::cout << "Story has " << parsed_states.size() << " states, " << trigger_name_table.size() << " triggers and " << flag_name_table.size() << " flags; states with no way out:";
+    for (auto const& name : dead_ends) {
+        std::cout << " " << name;
+    }
+    std::cout << std::endl;
+
+    // Speakers are interned as they're first seen; each gets its color from speakers.txt ("Name RRGGBB[AA]" per line)
+    std::unordered_map<std::string, Story::Speaker> speaker_colors;
+    {
+        std::ifstream speakers_file(data_path("speakers.txt"));
+        if (!speakers_file) {
+            std::cerr << "WARNING: couldn't read speakers.txt; every speaker gets the default color." << std::endl;
+        }
+        std::string speaker_line;
+        while (std::getline(speakers_file, speaker_line)) {
+            if (!speaker_line.empty() && speaker_line.back() == '\r') {
+                speaker_line.pop_back();
+            }
+            if (speaker_line.empty() || speaker_line[0] == '#') {
+                continue;
+            }
+            // (the color is the last word, so names may have spaces in them)
+            size_t space = speaker_line.find_last_of(' ');
+            std::string color = (space == std::string::npos ? "" : speaker_line.substr(space + 1));
+            if ((color.size() != 6 && color.size() != 8) || color.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos) {
+                std::cerr << "WARNING: couldn't read the line '" << speaker_line << "' of speakers.txt; expected 'Name RRGGBB'." << std::endl;
+                continue;
+            }
+            Story::Speaker speaker;
+            for (size_t i = 0; i < color.size() / 2; i++) {
+                speaker.color[i] = (uint8_t)std::stoul(color.substr(i * 2, 2), nullptr, 16);
+            }
+            speaker_colors[speaker_line.substr(0, space)] = speaker;
         }
+    }
+    std::vector<Story::Speaker> story_speakers;
+    std::unordered_map<std::string, uint32_t> speaker_ids;
+
+    // Everything goes into one story bundle, with each state's data appended to story-wide arrays
+    // (string offsets and condition indices are rebased to match)
+    std::vector<Story::StateEntry> toc;
+    std::vector<Story::Line> story_lines;
+    std::vector<Story::Transition> story_transitions;
+    std::vector<Story::Condition> story_conditions;
+    std::vector<Story::Edge> story_edges;
+    std::vector<Story::FlagDependency> flag_dependencies;
+    std::vector<Story::Glyph> story_glyphs;
+
+    for (ParsedState& state : parsed_states) {
+        size_t string_base = story_strings.size();
+        size_t condition_base = story_conditions.size();
+        size_t glyph_base = story_glyphs.size();
+        story_strings.insert(story_strings.end(), state.string_data.begin(), state.string_data.end());
 
-        /*
-        for (size_t i = state.lines_start; i < state.lines_end; i++) {
-            PlayMode::Line line = lines[i];
+        Story::StateEntry entry;
+        entry.name = state_name_table[toc.size()];
+        entry.lines_start = story_lines.size();
+        for (Story::Line line : state.lines) {
+            line.text_start += string_base;
+            line.text_end += string_base;
+            line.speaker_start += string_base;
+            line.speaker_end += string_base;
             if (line.spoken) {
-                std::cout << std::string(string_data.begin() + line.speaker_start, string_data.begin() + line.speaker_end) << ": ";
+                std::string speaker_name(story_strings.begin() + line.speaker_start, story_strings.begin() + line.speaker_end);
+                auto inserted = speaker_ids.emplace(speaker_name, (uint32_t)story_speakers.size());
+                if (inserted.second) {
+                    Story::Speaker speaker;
+                    auto found = speaker_colors.find(speaker_name);
+                    if (found != speaker_colors.end()) {
+                        speaker = found->second;
+                    } else {
+                        std::cerr << "WARNING: speaker '" << speaker_name << "' in state '" << state.name << "' isn't in speakers.txt; using the default color." << std::endl;
+                        speaker.color[0] = 0xff; speaker.color[1] = 0xff; speaker.color[2] = 0xc0; speaker.color[3] = 0xff; // (PlayMode::default_color)
+                    }
+                    speaker.name.start = line.speaker_start;
+                    speaker.name.end = line.speaker_end;
+                    story_speakers.push_back(speaker);
+                }
+                line.speaker = inserted.first->second;
             }
-            std::cout << std::string(string_data.begin() + line.text_start, string_data.begin() + line.text_end) << std::endl << std::endl;
+
+            line.glyphs_start += glyph_base;
+            line.glyphs_end += glyph_base;
+            story_lines.push_back(line);
+        }
+        entry.lines_end = story_lines.size();
+        story_glyphs.insert(story_glyphs.end(), state.glyphs.begin(), state.glyphs.end());
+        entry.transitions_start = story_transitions.size();
+        for (Story::Transition transition : state.transitions) {
+            transition.trigger_start += string_base;
+            transition.trigger_end += string_base;
+            transition.preconditions_start += condition_base;
+            transition.preconditions_end += condition_base;
+            transition.postconditions_start += condition_base;
+            transition.postconditions_end += condition_base;
+            story_transitions.push_back(transition);
+        }
+        entry.transitions_end = story_transitions.size();
+        for (Story::Condition condition : state.conditions) {
+            condition.name_start += string_base;
+            condition.name_end += string_base;
+            story_conditions.push_back(condition);
         }
-        */
+        entry.edges_start = story_edges.size();
+        for (const Story::Edge& edge : state.edges) {
+            for (uint32_t i = edge.guards_start; i < edge.guards_end; i++) {
+                const Story::FlagTerm& term = story_flag_terms[i];
+                for (uint32_t bit = 0; bit < 64; bit++) {
+                    if (term.mask & (uint64_t(1) << bit)) {
+                        flag_dependencies.push_back(Story::FlagDependency{ (uint32_t)term.word * 64 + bit, (uint32_t)story_edges.size() });
+                    }
+                }
+            }
+            story_edges.push_back(edge);
+        }
+        entry.edges_end = story_edges.size();
+        entry.depth = depths[toc.size()];
+        entry.timeline_date = state.timeline_date;
+        toc.push_back(entry);
+    }
+    Story::Header header;
+    header.version = Story::Version;
+    header.state_count = (uint32_t)toc.size();
+    header.trigger_count = (uint32_t)trigger_name_table.size();
+    header.start_state = start->second;
+    header.flag_count = (uint32_t)flag_name_table.size();
+    header.flag_words = (header.flag_count + 63) / 64;
+    header.glyph_count = (uint32_t)story_glyphs.size();
+    if (bake) {
+        header.font_size = font_size;
+        header.font_hash = manifest.font_hash;
+    }
+
+    std::stable_sort(flag_dependencies.begin(), flag_dependencies.end(), [](const Story::FlagDependency& a, const Story::FlagDependency& b) {
+        return a.flag < b.flag;
+    });
 
-        // Write to file
-        std::ofstream ofile(data_path("assets/states/" + state_name), std::ios::binary);
-        write_chunk("line", lines, &ofile);
-        write_chunk("tran", transitions, &ofile);
-        write_chunk("cond", conditions, &ofile);
-        write_chunk("strn", string_data, &ofile);
-        ofile.close();
+    // Write the bundle; chunk payloads are 16-byte aligned in the file (and so in the page-aligned mapping),
+    // so all chunk data can be used in place once mapped
+    // (written to memory first: if the bundle came out the same, the file is left alone, so its modification time doesn't change)
+    // (no checksums: they would have to read the whole bundle when it is loaded, which is otherwise paged in as it's used)
+    std::ostringstream bundle;
+    write_chunk_file_header(&bundle, 16, 0, 16); // (with a table of contents, so readers can find chunks in any order)
+    write_chunk("stry", std::vector<Story::Header>{ header }, &bundle);
+    write_chunk("stat", toc, &bundle);
+    write_chunk("tnam", trigger_name_table, &bundle);
+    write_chunk("line", story_lines, &bundle);
+    write_chunk("tran", story_transitions, &bundle);
+    write_chunk("cond", story_conditions, &bundle);
+    write_chunk("edge", story_edges, &bundle);
+    write_chunk("fnam", flag_name_table, &bundle);
+    write_chunk("term", story_flag_terms, &bundle);
+    write_chunk("fdep", flag_dependencies, &bundle);
+    write_chunk("glyf", story_glyphs, &bundle);
+    write_chunk("spkr", story_speakers, &bundle);
+    write_chunk("strn", story_strings, &bundle);
+    std::string bundle_data = bundle.str();
+    uint64_t output_hash = Story::hashBytes(bundle_data.data(), bundle_data.size());
+    if (!std::filesystem::exists(output_path) || Story::hashFile(output_path) != output_hash) {
+        try {
+            replaceFile(output_path, bundle_data);
+        } catch (const std::exception& e) {
+            std::cerr << "Couldn't write the story to '" << output_path << "': " << e.what() << std::endl;
+            exit(1);
+        }
+        std::cout << "Wrote " << output_path << " (" << bundle_data.size() << " bytes)." << std::endl;
+    } else {
+        std::cout << "Story bundle is unchanged." << std::endl;
     }
 
-	return 0;
-}
\ No newline at end of file
+    // Record what this run was built from, for the next one
+    manifest.output_hash = output_hash;
+    std::vector<char> manifest_strings;
+    std::vector<ManifestEntry> manifest_entries;
+    for (size_t i = 0; i < state_names.size(); i++) {
+        ManifestEntry entry;
+        entry.name.start = manifest_strings.size();
+        manifest_strings.insert(manifest_strings.end(), state_names[i].begin(), state_names[i].end());
+        entry.name.end = manifest_strings.size();
+        entry.hash = state_hashes[i];
+        manifest_entries.push_back(entry);
+    }
+    std::ostringstream manifest_file;
+    write_chunk_file_header(&manifest_file, 8, ChunkFormat::ChunkChecksums);
+    write_chunk("pman", std::vector<Manifest>{ manifest }, &manifest_file);
+    write_chunk("mfil", manifest_entries, &manifest_file);
+    write_chunk("strn", manifest_strings, &manifest_file);
+    try {
+        replaceFile(cache_path + "/manifest", manifest_file.str());
+    } catch (const std::exception& e) {
+        std::cerr << "Couldn't write the pipeline cache's manifest: " << e.what() << std::endl;
+        exit(1);
+    }
+
+    if (check_bake) {
+        return checkBakedText(output_path, font_path, font_size);
+    }
+    return 0;
+}
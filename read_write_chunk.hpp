@@ -1,65 +1,548 @@
 #pragma once
 
+#include "Span.hpp"
+
 #include <iostream>
 #include <vector>
 #include <stdexcept>
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
 
-//helper function that reads an array of structures preceded by a simple header:
-//Expected format:
+//helper functions that read and write arrays of structures as "chunks" in a file.
+//
+//Chunk files come in two versions. v1 (the original format, and what the export scripts write)
+// is just a sequence of chunks, each an array of structures preceded by a simple header:
 // |ma|gi|c.|..| <-- four byte "magic number"
 // |sz|sz|sz|sz| <-- four byte (native endian) size
 // |TT...TT| * (sz/sizeof(TT)) <-- enough T structures to make up sz bytes
+//
+//v2 files start with a file header, written by write_chunk_file_header():
+// |ch|k2|..|..| <-- "chk2"
+// |al|al|al|al| <-- payload alignment (a power of two)
+// |fl|fl|fl|fl| <-- flags (ChunkChecksums: every chunk carries a CRC32 of its payload; ChunkCompression: chunks may be compressed)
+// |00|00|00|00|
+//followed by chunks with 64-bit sizes and aligned payloads:
+// |ma|gi|c.|..| <-- four byte "magic number"
+// |fl|fl|fl|fl| <-- flags (ChunkChecksums: crc is set; ChunkCompression: the payload is compressed)
+// |sz|sz|sz|sz|sz|sz|sz|sz| <-- eight byte (native endian) size
+// |cr|cr|cr|cr| <-- CRC32 of the payload
+// |pd|pd|pd|pd| <-- number of zero bytes between this header and the payload
+// |00...00| <-- padding, so the payload starts at a multiple of the alignment (counting from the start of the file)
+// |TT...TT| * (sz/sizeof(TT))
+//
+//Compressed chunks are written and read by compressed_chunk.hpp (which needs zlib); read_chunk and the in-place
+// readers below refuse them, since their payload has to be inflated before it can be used (ChunkView inflates
+// them into a copy if it is given a way to, as Mesh and Scene loaders do).
+//
+//A v2 file may also start with a table of contents: a "toc0" chunk of ChunkTocEntry, one per chunk that follows
+// (reserved by write_chunk_file_header and filled in by write_chunk), so a reader can go straight to any chunk
+// without reading the ones before it (see ChunkView::find). read_chunk skips it unless it is asked for "toc0".
+//
+//Readers accept both: read_chunk_file_header() / view_chunk_file_header() look for a v2 header and
+// otherwise leave the data alone, so the chunks that follow are read as v1.
+//The version of a stream is remembered with the stream itself (see chunk_format()), so read_chunk and
+// write_chunk use whatever format the file header said.
 
-template< typename T >
-void read_chunk(std::istream &from, std::string const &magic, std::vector< T > *to_) {
+struct ChunkFormat {
+	uint32_t version = 1;
+	uint32_t alignment = 1; //payloads start at a multiple of this offset in the file (v2 only)
+	uint32_t flags = 0;
+	enum : uint32_t {
+		ChunkChecksums = 1,
+		ChunkCompression = 2,
+	};
+};
+
+//-- internals --
+
+struct ChunkHeaderV1 {
+	char magic[4] = {'\0', '\0', '\0', '\0'};
+	uint32_t size = 0;
+};
+static_assert(sizeof(ChunkHeaderV1) == 8, "header is packed");
+
+struct ChunkFileHeader {
+	char magic[4] = {'c', 'h', 'k', '2'};
+	uint32_t alignment = 16;
+	uint32_t flags = 0;
+	uint32_t reserved = 0;
+};
+static_assert(sizeof(ChunkFileHeader) == 16, "header is packed");
+
+struct ChunkHeaderV2 {
+	char magic[4] = {'\0', '\0', '\0', '\0'};
+	uint32_t flags = 0;
+	uint64_t size = 0;
+	uint32_t crc32 = 0;
+	uint32_t padding = 0;
+};
+static_assert(sizeof(ChunkHeaderV2) == 24, "header is packed");
+
+struct ChunkTocEntry {
+	char magic[4] = {'\0', '\0', '\0', '\0'}; //(all zero for unused entries)
+	uint32_t reserved = 0;
+	uint64_t offset = 0; //of the chunk's header, from the start of the file
+	uint64_t size = 0; //of the chunk's payload
+};
+static_assert(sizeof(ChunkTocEntry) == 24, "entry is packed");
+
+//CRC-32 (the zlib/PNG one), continuing from 'crc':
+inline uint32_t chunk_crc32(void const *data, size_t size, uint32_t crc = 0) {
+	static std::array< uint32_t, 256 > const table = [](){
+		std::array< uint32_t, 256 > ret;
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t c = i;
+			for (uint32_t k = 0; k < 8; ++k) {
+				c = (c & 1) ? (0xedb88320u ^ (c >> 1)) : (c >> 1);
+			}
+			ret[i] = c;
+		}
+		return ret;
+	}();
+	uint8_t const *bytes = reinterpret_cast< uint8_t const * >(data);
+	crc = ~crc;
+	for (size_t i = 0; i < size; ++i) {
+		crc = table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+//a stream's chunk format is kept in one of its iword slots, as version | log2(alignment) << 8 | flags << 16:
+// (zero, the default, means v1)
+inline int chunk_format_index() {
+	static int const index = std::ios_base::xalloc();
+	return index;
+}
+
+inline ChunkFormat chunk_format(std::ios_base &stream) {
+	long word = stream.iword(chunk_format_index());
+	ChunkFormat format;
+	if (word != 0) {
+		format.version = uint32_t(word & 0xff);
+		format.alignment = uint32_t(1) << ((word >> 8) & 0xff);
+		format.flags = uint32_t((word >> 16) & 0xff);
+	}
+	return format;
+}
+
+inline void set_chunk_format(std::ios_base &stream, ChunkFormat const &format) {
+	long log2_alignment = 0;
+	while ((uint32_t(1) << log2_alignment) < format.alignment) ++log2_alignment;
+	stream.iword(chunk_format_index()) = (format.version == 1 ? 0 : long(format.version) | (log2_alignment << 8) | (long(format.flags) << 16));
+}
+
+//a stream's table of contents (if it has one) is tracked in two more iword slots:
+inline int chunk_toc_capacity_index() {
+	static int const index = std::ios_base::xalloc();
+	return index;
+}
+inline int chunk_toc_count_index() {
+	static int const index = std::ios_base::xalloc();
+	return index;
+}
+
+//the table of contents' entries come right after the file header and the "toc0" chunk header (and its padding):
+inline uint64_t chunk_toc_entries_offset(ChunkFormat const &format) {
+	uint64_t payload = sizeof(ChunkFileHeader) + sizeof(ChunkHeaderV2);
+	return payload + (format.alignment - payload % format.alignment) % format.alignment;
+}
+
+inline bool valid_chunk_file_header(ChunkFileHeader const &header) {
+	return std::string(header.magic, 4) == "chk2"
+		&& header.alignment >= 1 && header.alignment <= 4096 && (header.alignment & (header.alignment - 1)) == 0
+		&& (header.flags & ~uint32_t(ChunkFormat::ChunkChecksums | ChunkFormat::ChunkCompression)) == 0;
+}
+
+//where a stream ends is remembered in two more iword slots, so chunk sizes can be checked against it without seeking
+// for every chunk; the slots hold the end's offset plus two, in 32-bit halves (zero: not known yet; one: the stream can't say):
+inline int chunk_stream_end_low_index() {
+	static int const index = std::ios_base::xalloc();
+	return index;
+}
+inline int chunk_stream_end_high_index() {
+	static int const index = std::ios_base::xalloc();
+	return index;
+}
+
+//find (and remember) where a stream ends; read_chunk_file_header does this once per file:
+inline void remember_chunk_stream_end(std::istream &from) {
+	uint64_t code = 1;
+	std::streampos at = from.tellg();
+	if (at != std::streampos(-1)) {
+		from.seekg(0, std::ios::end);
+		std::streampos end = from.tellg();
+		if (from && end != std::streampos(-1)) code = uint64_t(std::streamoff(end)) + 2;
+		from.clear();
+		from.seekg(at);
+	}
+	from.iword(chunk_stream_end_low_index()) = long(uint32_t(code));
+	from.iword(chunk_stream_end_high_index()) = long(uint32_t(code >> 32));
+}
+
+//bytes left in a stream, or -1 if it can't say (e.g., a pipe):
+// (streams read without read_chunk_file_header learn where they end the first time they're asked)
+inline int64_t chunk_stream_remaining(std::istream &from) {
+	auto code = [&from]() {
+		return uint64_t(uint32_t(from.iword(chunk_stream_end_low_index()))) | (uint64_t(uint32_t(from.iword(chunk_stream_end_high_index()))) << 32);
+	};
+	if (code() == 0) remember_chunk_stream_end(from);
+	uint64_t end = code();
+	std::streampos at = from.tellg();
+	if (end == 1 || at == std::streampos(-1)) return -1;
+	end -= 2;
+	return uint64_t(std::streamoff(at)) < end ? int64_t(end - uint64_t(std::streamoff(at))) : 0;
+}
+
+//--
+
+inline void write_chunk_data(std::string const &magic, char const *data, uint64_t size, uint32_t flags, std::ostream *to_);
+
+//start a v2 chunk file; later write_chunk calls on the same stream write v2 chunks:
+// (alignment must be a power of two, at most 4096; flags may include ChunkFormat::ChunkChecksums)
+// if toc_capacity isn't zero, a table of contents with room for that many chunks is written first
+// (the stream must then be seekable, since each write_chunk goes back to fill in its entry)
+inline void write_chunk_file_header(std::ostream *to_, uint32_t alignment = 16, uint32_t flags = 0, uint32_t toc_capacity = 0) {
 	assert(to_);
 	auto &to = *to_;
 
-	struct ChunkHeader {
-		char magic[4] = {'\0', '\0', '\0', '\0'};
-		uint32_t size = 0;
-	};
-	static_assert(sizeof(ChunkHeader) == 8, "header is packed");
+	ChunkFileHeader header;
+	header.alignment = alignment;
+	header.flags = flags;
+	if (!valid_chunk_file_header(header)) {
+		throw std::runtime_error("Chunk alignment must be a power of two no larger than 4096.");
+	}
+	to.write(reinterpret_cast< const char * >(&header), sizeof(header));
+
+	ChunkFormat format;
+	format.version = 2;
+	format.alignment = alignment;
+	format.flags = flags;
+	set_chunk_format(to, format);
+
+	to.iword(chunk_toc_capacity_index()) = 0;
+	to.iword(chunk_toc_count_index()) = 0;
+	if (toc_capacity > 0) {
+		std::vector< ChunkTocEntry > toc(toc_capacity);
+		write_chunk_data("toc0", reinterpret_cast< char const * >(toc.data()), toc.size() * sizeof(ChunkTocEntry), 0, &to);
+		to.iword(chunk_toc_capacity_index()) = long(toc_capacity);
+	}
+}
 
-	ChunkHeader header;
-	if (!from.read(reinterpret_cast< char * >(&header), sizeof(header))) {
-		throw std::runtime_error("Failed to read chunk header");
+//check for a v2 file header; if there is one, it is read and later read_chunk calls on the stream expect v2 chunks,
+// otherwise nothing is read and the stream is left to be read as v1:
+inline ChunkFormat read_chunk_file_header(std::istream &from) {
+	remember_chunk_stream_end(from);
+	std::streampos start = from.tellg();
+	ChunkFileHeader header;
+	if (from.read(reinterpret_cast< char * >(&header), sizeof(header)) && std::string(header.magic, 4) == "chk2") {
+		if (!valid_chunk_file_header(header)) {
+			throw std::runtime_error("Chunk file header has an unsupported alignment or flags.");
+		}
+		ChunkFormat format;
+		format.version = 2;
+		format.alignment = header.alignment;
+		format.flags = header.flags;
+		set_chunk_format(from, format);
+		return format;
 	}
-	if (std::string(header.magic,4) != magic) {
+	from.clear();
+	from.seekg(start);
+	set_chunk_format(from, ChunkFormat());
+	return ChunkFormat();
+}
+
+//the same, for chunk data stored in memory (*at_ is advanced past the header if there is one):
+inline ChunkFormat view_chunk_file_header(char const **at_, char const *end) {
+	assert(at_);
+	auto &at = *at_;
+
+	ChunkFileHeader header;
+	if (size_t(end - at) < sizeof(header)) return ChunkFormat();
+	std::memcpy(&header, at, sizeof(header));
+	if (std::string(header.magic, 4) != "chk2") return ChunkFormat();
+	if (!valid_chunk_file_header(header)) {
+		throw std::runtime_error("Chunk file header has an unsupported alignment or flags.");
+	}
+	at += sizeof(header);
+	ChunkFormat format;
+	format.version = 2;
+	format.alignment = header.alignment;
+	format.flags = header.flags;
+	return format;
+}
+
+//-- internals --
+//a chunk header read from a stream (what read_chunk needs to know to read its payload):
+struct ChunkStreamHeader {
+	uint64_t size = 0;
+	uint32_t crc32 = 0;
+	bool check = false; //(crc32 is set)
+	bool compressed = false; //(the payload is a compressed chunk payload; see compressed_chunk.hpp)
+};
+
+//read the header of the next chunk (and its padding), which must have the given magic number:
+inline ChunkStreamHeader read_chunk_header(std::istream &from, std::string const &magic) {
+	ChunkFormat format = chunk_format(from);
+	ChunkStreamHeader ret;
+	char header_magic[4];
+	if (format.version == 1) {
+		ChunkHeaderV1 header;
+		if (!from.read(reinterpret_cast< char * >(&header), sizeof(header))) {
+			throw std::runtime_error("Failed to read chunk header");
+		}
+		std::memcpy(header_magic, header.magic, 4);
+		ret.size = header.size;
+	} else {
+		ChunkHeaderV2 header;
+		if (!from.read(reinterpret_cast< char * >(&header), sizeof(header))) {
+			throw std::runtime_error("Failed to read chunk header");
+		}
+		//a table of contents is only for readers that jump around, so reading chunks in order just skips it:
+		if (std::string(header.magic, 4) == "toc0" && magic != "toc0") {
+			if (header.padding >= format.alignment || !from.ignore(std::streamsize(header.padding + header.size))
+				|| !from.read(reinterpret_cast< char * >(&header), sizeof(header))) {
+				throw std::runtime_error("Failed to read chunk header");
+			}
+		}
+		std::memcpy(header_magic, header.magic, 4);
+		ret.size = header.size;
+		ret.crc32 = header.crc32;
+		ret.check = (header.flags & ChunkFormat::ChunkChecksums) != 0;
+		ret.compressed = (header.flags & ChunkFormat::ChunkCompression) != 0;
+		if (header.padding >= format.alignment || !from.ignore(header.padding)) {
+			throw std::runtime_error("Failed to read chunk padding");
+		}
+	}
+	if (std::string(header_magic,4) != magic) {
 		throw std::runtime_error("Unexpected magic number in chunk");
 	}
+	return ret;
+}
+
+//read the payload of a chunk whose header was just read, as stored:
+template< typename T, typename A >
+void read_chunk_payload(std::istream &from, ChunkStreamHeader const &header, std::vector< T, A > *to_) {
+	static_assert(std::is_trivially_copyable< T >::value, "chunks hold plain data");
+	assert(to_);
+	auto &to = *to_;
 
 	if (header.size % sizeof(T) != 0) {
 		throw std::runtime_error("Size of chunk not divisible by element size");
 	}
 
-	to.resize(header.size / sizeof(T));
-	if (!from.read(reinterpret_cast< char * >(&to[0]), to.size() * sizeof(T))) {
+	//a damaged size shouldn't allocate memory for data that isn't there, so it is checked against what's left of the stream
+	// (when the stream can tell), and then the vector is allocated once, at its final size:
+	int64_t left = chunk_stream_remaining(from);
+	if (left >= 0 && uint64_t(left) < header.size) {
 		throw std::runtime_error("Failed to read chunk data.");
 	}
-}
+	size_t const count = size_t(header.size / sizeof(T));
+	to.clear();
+	to.reserve(count);
 
+	//it is read into a piece at a time, so the checksum is computed while each piece is still in cache
+	// (a chunk_vector's new elements are left uninitialized; any other vector zeroes each piece before it is read over):
+	size_t const piece = std::max< size_t >(1, (256 << 10) / sizeof(T));
+	uint32_t crc = 0;
+	while (to.size() < count) {
+		size_t first = to.size();
+		size_t n = std::min(piece, count - first);
+		to.resize(first + n);
+		if (!from.read(reinterpret_cast< char * >(to.data() + first), n * sizeof(T))) {
+			throw std::runtime_error("Failed to read chunk data.");
+		}
+		if (header.check) crc = chunk_crc32(to.data() + first, n * sizeof(T), crc);
+	}
+	if (header.check && crc != header.crc32) {
+		throw std::runtime_error("Chunk data doesn't match its checksum.");
+	}
+}
 
-//helper function to write a chunk of data in the same format as read_chunk:
-template< typename T >
-void write_chunk(std::string const &magic, std::vector< T > const &from, std::ostream *to_) {
+//write a chunk's header (and padding, and table of contents entry) and then its payload, as stored:
+inline void write_chunk_data(std::string const &magic, char const *data, uint64_t size, uint32_t flags, std::ostream *to_) {
 	assert(magic.size() == 4);
 	assert(to_);
 	auto &to = *to_;
 
-	struct ChunkHeader {
-		char magic[4] = {'\0', '\0', '\0', '\0'};
-		uint32_t size = 0;
-	};
-	static_assert(sizeof(ChunkHeader) == 8, "header is packed");
-	ChunkHeader header;
-	header.magic[0] = magic[0];
-	header.magic[1] = magic[1];
-	header.magic[2] = magic[2];
-	header.magic[3] = magic[3];
-	header.size = uint32_t(from.size() * sizeof(T));
+	ChunkFormat format = chunk_format(to);
+	if (format.version == 1) {
+		if (size > 0xffffffffu) {
+			throw std::runtime_error("Chunk '" + magic + "' is too large for a v1 chunk file (use write_chunk_file_header).");
+		}
+		ChunkHeaderV1 header;
+		std::memcpy(header.magic, magic.data(), 4);
+		header.size = uint32_t(size);
+		to.write(reinterpret_cast< const char * >(&header), sizeof(header));
+	} else {
+		std::streamoff position = std::streamoff(to.tellp());
+		if (position < 0) {
+			throw std::runtime_error("v2 chunks need a stream that knows its position.");
+		}
+		ChunkHeaderV2 header;
+		std::memcpy(header.magic, magic.data(), 4);
+		header.flags = flags;
+		header.size = size;
+		if ((format.flags & ChunkFormat::ChunkChecksums) && magic != "toc0") { //(the table of contents is filled in after it is written)
+			header.flags |= ChunkFormat::ChunkChecksums;
+			header.crc32 = chunk_crc32(data, size_t(size));
+		}
+		uint64_t payload = uint64_t(position) + sizeof(header);
+		header.padding = uint32_t((format.alignment - payload % format.alignment) % format.alignment);
+		to.write(reinterpret_cast< const char * >(&header), sizeof(header));
+		static char const zeros[4096] = {};
+		to.write(zeros, header.padding);
 
-	to.write(reinterpret_cast< const char * >(&header), sizeof(header));
-	to.write(reinterpret_cast< const char * >(from.data()), from.size() * sizeof(T));
+		//fill in this chunk's entry in the table of contents:
+		long toc_capacity = to.iword(chunk_toc_capacity_index());
+		if (toc_capacity > 0) {
+			long &toc_count = to.iword(chunk_toc_count_index());
+			if (toc_count >= toc_capacity) {
+				throw std::runtime_error("Chunk '" + magic + "' doesn't fit in the file's table of contents.");
+			}
+			ChunkTocEntry entry;
+			std::memcpy(entry.magic, magic.data(), 4);
+			entry.offset = uint64_t(position);
+			entry.size = size;
+			to.seekp(std::streamoff(chunk_toc_entries_offset(format) + uint64_t(toc_count) * sizeof(ChunkTocEntry)));
+			to.write(reinterpret_cast< const char * >(&entry), sizeof(entry));
+			to.seekp(0, std::ios::end);
+			toc_count += 1;
+		}
+	}
+	to.write(data, std::streamsize(size));
+}
+
+//--
+
+//an allocator for vectors that chunks are read into, which leaves the elements that resize() adds uninitialized
+// rather than zeroing them (read_chunk reads over them right away); other constructions work as usual:
+template< typename T >
+struct chunk_allocator : std::allocator< T > {
+	static_assert(std::is_trivially_copyable< T >::value && std::is_trivially_destructible< T >::value, "chunks hold plain data");
+	template< typename U > struct rebind { using other = chunk_allocator< U >; };
+	chunk_allocator() = default;
+	template< typename U > chunk_allocator(chunk_allocator< U > const &) noexcept { }
+	template< typename U > void construct(U *) noexcept { }
+	template< typename U, typename... Args > void construct(U *at, Args &&... args) {
+		::new(static_cast< void * >(at)) U(std::forward< Args >(args)...);
+	}
+};
+template< typename T >
+using chunk_vector = std::vector< T, chunk_allocator< T > >;
+
+//helper function that reads a chunk (v1, or v2 if the stream's file header said so):
+// (read into a chunk_vector to skip zeroing the vector first; compressed chunks are read with read_compressed_chunk, from compressed_chunk.hpp)
+template< typename T, typename A >
+void read_chunk(std::istream &from, std::string const &magic, std::vector< T, A > *to_) {
+	ChunkStreamHeader header = read_chunk_header(from, magic);
+	if (header.compressed) {
+		throw std::runtime_error("Chunk '" + magic + "' is compressed (read it with read_compressed_chunk).");
+	}
+	read_chunk_payload(from, header, to_);
+}
+
+
+//helper function to write a chunk of data in the same format as read_chunk:
+// (v1 unless write_chunk_file_header was called on the stream first)
+template< typename T, typename A >
+void write_chunk(std::string const &magic, std::vector< T, A > const &from, std::ostream *to_) {
+	write_chunk_data(magic, reinterpret_cast< char const * >(from.data()), uint64_t(from.size()) * sizeof(T), 0, to_);
+}
+
+//-- internals --
+//where a chunk stored in memory is, from its header alone (without looking at -- or paging in -- its payload):
+struct ChunkExtent {
+	char magic[4] = {'\0', '\0', '\0', '\0'};
+	uint64_t size = 0;
+	uint32_t crc32 = 0;
+	bool check = false; //(crc32 is set)
+	bool compressed = false; //(data is a compressed chunk payload)
+	char const *data = nullptr;
+};
+inline ChunkExtent chunk_extent(char const *at, char const *end, ChunkFormat const &format) {
+	ChunkExtent extent;
+	if (format.version == 1) {
+		ChunkHeaderV1 header;
+		if (size_t(end - at) < sizeof(header)) {
+			throw std::runtime_error("Failed to read chunk header");
+		}
+		std::memcpy(&header, at, sizeof(header));
+		std::memcpy(extent.magic, header.magic, 4);
+		extent.size = header.size;
+		extent.data = at + sizeof(header);
+	} else {
+		ChunkHeaderV2 header;
+		if (size_t(end - at) < sizeof(header)) {
+			throw std::runtime_error("Failed to read chunk header");
+		}
+		std::memcpy(&header, at, sizeof(header));
+		if (header.padding >= format.alignment || size_t(end - at) - sizeof(header) < header.padding) {
+			throw std::runtime_error("Failed to read chunk padding");
+		}
+		std::memcpy(extent.magic, header.magic, 4);
+		extent.size = header.size;
+		extent.data = at + sizeof(header) + header.padding;
+		extent.crc32 = header.crc32;
+		extent.check = (header.flags & ChunkFormat::ChunkChecksums) != 0;
+		extent.compressed = (header.flags & ChunkFormat::ChunkCompression) != 0;
+	}
+	if (uint64_t(end - extent.data) < extent.size) {
+		throw std::runtime_error("Failed to read chunk data.");
+	}
+	return extent;
+}
+
+//the extent of the chunk at *at_, which must have the given magic number (and match its checksum, if it has one);
+// *at_ is advanced past the chunk:
+inline ChunkExtent view_chunk_extent(char const **at_, char const *end, std::string const &magic, ChunkFormat const &format) {
+	assert(at_);
+	auto &at = *at_;
+
+	ChunkExtent extent = chunk_extent(at, end, format);
+	if (std::string(extent.magic,4) != magic) {
+		throw std::runtime_error("Unexpected magic number in chunk");
+	}
+	//(checking reads the whole chunk, so files meant to be paged in lazily are best written without checksums)
+	if (extent.check && chunk_crc32(extent.data, size_t(extent.size)) != extent.crc32) {
+		throw std::runtime_error("Chunk data doesn't match its checksum.");
+	}
+
+	at = extent.data + extent.size;
+	return extent;
+}
+
+//--
+
+//helper function that views the bytes of a chunk (in the same format as read_chunk) stored in memory -- e.g. a memory-mapped file -- in place, without copying:
+// (*at_ is advanced past the chunk; 'format' comes from view_chunk_file_header)
+inline Span< char const > view_chunk_data(char const **at_, char const *end, std::string const &magic, ChunkFormat const &format = ChunkFormat()) {
+	assert(at_);
+	char const *after = *at_;
+	ChunkExtent extent = view_chunk_extent(&after, end, magic, format);
+	if (extent.compressed) {
+		throw std::runtime_error("Chunk '" + magic + "' is compressed, so it can't be viewed in place (read it with read_compressed_chunk).");
+	}
+
+	*at_ = after;
+	return Span< char const >(extent.data, size_t(extent.size));
+}
+
+//helper function that views a chunk as an array of T, in place:
+// (the chunk's data must be suitably aligned for T; see ChunkView.hpp for a reader that copies chunks that aren't)
+template< typename T >
+Span< T const > view_chunk(char const **at_, char const *end, std::string const &magic, ChunkFormat const &format = ChunkFormat()) {
+	Span< char const > data = view_chunk_data(at_, end, magic, format);
+	if (data.size() % sizeof(T) != 0) {
+		throw std::runtime_error("Size of chunk not divisible by element size");
+	}
+	if (reinterpret_cast< uintptr_t >(data.data()) % alignof(T) != 0) {
+		throw std::runtime_error("Chunk data is not aligned for its element type.");
+	}
+	return Span< T const >(reinterpret_cast< T const * >(data.data()), data.size() / sizeof(T));
 }
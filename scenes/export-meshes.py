@@ -14,8 +14,12 @@ for i in range(0,len(sys.argv)):
 	if sys.argv[i] == '--':
 		args = sys.argv[i+1:]
 
+compress = '--compress' in args
+if compress:
+	args.remove('--compress')
+
 if len(args) != 2:
-	print("\n\nUsage:\nblender --background --python export-meshes.py -- <infile.blend[:collection]> <outfile.pnct>\nExports the meshes referenced by all objects in the specified collection(s) (default: all objects) to a binary blob.\n")
+	print("\n\nUsage:\nblender --background --python export-meshes.py -- [--compress] <infile.blend[:collection]> <outfile.pnct>\nExports the meshes referenced by all objects in the specified collection(s) (default: all objects) to a binary blob.\n--compress writes zlib-compressed chunks (see compressed_chunk.hpp).\n")
 	exit(1)
 
 import bpy
@@ -38,6 +42,10 @@ else:
 print(" of '" + infile + "' to '" + outfile + "'.")
 
 import struct
+import os
+
+sys.path.append(os.path.dirname(os.path.abspath(__file__)))
+from write_chunks import ChunkWriter
 
 bpy.ops.wm.open_mainfile(filepath=infile)
 
@@ -198,19 +206,17 @@ assert(vertex_count * (4*3+4*3+1*4+4*2) == len(data))
 
 #write the data chunk and index chunk to an output blob:
 blob = open(outfile, 'wb')
+chunks = ChunkWriter(blob, compress)
 #first chunk: the data
-blob.write(struct.pack('4s',b'pnct')) #type
-blob.write(struct.pack('I', len(data))) #length
-blob.write(data)
+chunks.write(b'pnct', data)
 #second chunk: the strings
-blob.write(struct.pack('4s',b'str0')) #type
-blob.write(struct.pack('I', len(strings))) #length
-blob.write(strings)
+chunks.write(b'str0', strings)
 #third chunk: the index
-blob.write(struct.pack('4s',b'idx0')) #type
-blob.write(struct.pack('I', len(index))) #length
-blob.write(index)
+chunks.write(b'idx0', index)
 wrote = blob.tell()
 blob.close()
 
-print("Wrote " + str(wrote) + " bytes [== " + str(len(data)+8) + " bytes of data + " + str(len(strings)+8) + " bytes of strings + " + str(len(index)+8) + " bytes of index] to '" + outfile + "'")
+if compress:
+	print("Wrote " + str(wrote) + " bytes [compressed from " + str(len(data)) + " bytes of data + " + str(len(strings)) + " bytes of strings + " + str(len(index)) + " bytes of index] to '" + outfile + "'")
+else:
+	print("Wrote " + str(wrote) + " bytes [== " + str(len(data)+8) + " bytes of data + " + str(len(strings)+8) + " bytes of strings + " + str(len(index)+8) + " bytes of index] to '" + outfile + "'")
@@ -12,8 +12,12 @@ for i in range(0,len(sys.argv)):
 	if sys.argv[i] == '--':
 		args = sys.argv[i+1:]
 
+compress = '--compress' in args
+if compress:
+	args.remove('--compress')
+
 if len(args) != 2:
-	print("\n\nUsage:\nblender --background --python export-scene.py -- <infile.blend>[:collection] <outfile.scene>\nExports the transforms of objects in collection (default: master collection) to a binary blob, indexed by the names of the objects that reference them.\n")
+	print("\n\nUsage:\nblender --background --python export-scene.py -- [--compress] <infile.blend>[:collection] <outfile.scene>\nExports the transforms of objects in collection (default: master collection) to a binary blob, indexed by the names of the objects that reference them.\n--compress writes zlib-compressed chunks (see compressed_chunk.hpp).\n")
 	exit(1)
 
 
@@ -37,6 +41,10 @@ import bpy
 import mathutils
 import struct
 import math
+import os
+
+sys.path.append(os.path.dirname(os.path.abspath(__file__)))
+from write_chunks import ChunkWriter
 
 #---------------------------------------------------------------------
 #Export scene:
@@ -215,16 +223,13 @@ write_objects(collection)
 
 #write the strings chunk and scene chunk to an output blob:
 blob = open(outfile, 'wb')
-def write_chunk(magic, data):
-	blob.write(struct.pack('4s',magic)) #type
-	blob.write(struct.pack('I', len(data))) #length
-	blob.write(data)
-
-write_chunk(b'str0', strings_data)
-write_chunk(b'xfh0', xfh_data)
-write_chunk(b'msh0', mesh_data)
-write_chunk(b'cam0', camera_data)
-write_chunk(b'lmp0', lamp_data)
+chunks = ChunkWriter(blob, compress)
+
+chunks.write(b'str0', strings_data)
+chunks.write(b'xfh0', xfh_data)
+chunks.write(b'msh0', mesh_data)
+chunks.write(b'cam0', camera_data)
+chunks.write(b'lmp0', lamp_data)
 
 print("Wrote " + str(blob.tell()) + " bytes to '" + outfile + "'")
 blob.close()
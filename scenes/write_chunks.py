@@ -0,0 +1,55 @@
+#helpers for export-meshes.py and export-scene.py that write chunk files (see read_write_chunk.hpp):
+# by default, v1 files (a four-byte magic number and a four-byte size before each chunk);
+# with compress=True, v2 files whose chunks are zlib-compressed in blocks (see compressed_chunk.hpp),
+#  which the game inflates in parallel as it loads them
+
+import struct
+import zlib
+
+#v2 file and chunk flags (ChunkFormat in read_write_chunk.hpp):
+ChunkChecksums = 1
+ChunkCompression = 2
+
+#deflate data into a compressed chunk payload, as deflate_chunk in compressed_chunk.hpp does:
+# (returns None if compressing wouldn't make the data any smaller)
+def deflate_chunk(data, block_size = 256 << 10):
+	block_count = (len(data) + block_size - 1) // block_size
+	blocks = [zlib.compress(data[i*block_size:(i+1)*block_size]) for i in range(block_count)]
+	table_size = 16 + 16 * block_count
+	if table_size + sum(len(block) for block in blocks) >= len(data):
+		return None
+	payload = struct.pack('QII', len(data), block_size, block_count) #ChunkBlockTable
+	offset = table_size
+	for block in blocks:
+		payload += struct.pack('QQ', offset, len(block)) #ChunkBlock
+		offset += len(block)
+	return payload + b"".join(blocks)
+
+class ChunkWriter:
+	def __init__(self, blob, compress = False, alignment = 16):
+		self.blob = blob
+		self.compress = compress
+		self.alignment = alignment
+		if compress:
+			#file header: magic, alignment, flags, reserved
+			blob.write(struct.pack('4sIII', b'chk2', alignment, ChunkChecksums | ChunkCompression, 0))
+
+	def write(self, magic, data):
+		if not self.compress:
+			self.blob.write(struct.pack('4s',magic)) #type
+			self.blob.write(struct.pack('I', len(data))) #length
+			self.blob.write(data)
+			return
+		flags = ChunkChecksums
+		payload = deflate_chunk(data)
+		if payload is None:
+			payload = data
+		else:
+			flags |= ChunkCompression
+		#payloads start at a multiple of the alignment (counting from the start of the file):
+		payload_start = self.blob.tell() + 24
+		padding = (self.alignment - payload_start % self.alignment) % self.alignment
+		#chunk header: magic, flags, size, crc32 (of the payload as stored), padding
+		self.blob.write(struct.pack('4sIQII', magic, flags, len(payload), zlib.crc32(payload) & 0xffffffff, padding))
+		self.blob.write(b"\0" * padding)
+		self.blob.write(payload)
@@ -3,6 +3,7 @@
 #include "Load.hpp"
 #include "GL.hpp"
 #include "load_save_png.hpp"
+#include "StreamBuffer.hpp"
 #include "ShowSceneProgram.hpp"
 
 #include <SDL.h>
@@ -214,6 +215,9 @@ int main(int argc, char **argv) {
 		{ //(3) call the current mode's "draw" function to produce output:
 		
 			Mode::current->draw(drawable_size);
+
+			//streamed geometry for this frame may be reused once the GPU is done with it:
+			StreamBuffer::shared().end_frame();
 		}
 
 		//Wait until the recently-drawn frame is shown before doing it all again:
@@ -0,0 +1,208 @@
+//story-sim: plays the story bundle with no window, as fast as possible, to check and benchmark it.
+// (random mode plays many random playthroughs; exhaustive mode plays every trigger sequence up to some length)
+
+#include "Story.hpp"
+#include "data_path.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+//triggers that lead somewhere from the playthrough's current state (first edge of each trigger group):
+static void live_triggers(Playthrough const &playthrough, std::vector< uint32_t > *triggers) {
+	triggers->clear();
+	for (Story::Edge const &edge : playthrough.story.states[playthrough.current_state].edges) {
+		if (!triggers->empty() && triggers->back() == edge.trigger) continue;
+		if (playthrough.liveEdge(edge.trigger)) triggers->emplace_back(edge.trigger);
+	}
+}
+
+struct Stats {
+	uint64_t playthroughs = 0;
+	uint64_t steps = 0;
+	uint64_t cut_off = 0; //playthroughs that hit the step limit instead of a state with no way out
+	uint64_t live_mismatches = 0; //edges whose incrementally-updated liveness disagreed with their guards
+	std::vector< uint64_t > lengths; //lengths[n] is the number of playthroughs that took n steps
+	std::vector< uint64_t > state_visits;
+	std::vector< uint64_t > edge_uses;
+
+	void record(Playthrough const &playthrough, uint32_t length, bool stuck, bool check) {
+		playthroughs += 1;
+		if (!stuck) cut_off += 1;
+		if (lengths.size() <= length) lengths.resize(length + 1, 0);
+		lengths[length] += 1;
+
+		//the incremental edge liveness must match a full re-check:
+		// (this costs more than the playthrough itself, so it's done in a separate, untimed pass)
+		if (check) {
+			for (uint32_t i = 0; i < playthrough.story.edges.size(); ++i) {
+				if (playthrough.edge_live[i] != playthrough.guardsHold(playthrough.story.edges[i])) live_mismatches += 1;
+			}
+		}
+	}
+};
+
+static bool step(Playthrough *playthrough, uint32_t trigger, Stats *stats) {
+	Story::Edge const *edge = playthrough->useTrigger(trigger);
+	if (!edge) return false;
+	stats->steps += 1;
+	stats->edge_uses[playthrough->story.edgeIndex(*edge)] += 1;
+	stats->state_visits[playthrough->current_state] += 1;
+	return true;
+}
+
+static void explore(Playthrough const &playthrough, uint32_t length, uint32_t max_steps, bool check, Stats *stats) {
+	std::vector< uint32_t > triggers;
+	live_triggers(playthrough, &triggers);
+	if (triggers.empty() || length == max_steps) {
+		stats->record(playthrough, length, triggers.empty(), check);
+		return;
+	}
+	for (uint32_t trigger : triggers) {
+		Playthrough next = playthrough;
+		step(&next, trigger, stats);
+		explore(next, length + 1, max_steps, check, stats);
+	}
+}
+
+struct Options {
+	bool exhaustive = false;
+	uint64_t runs = 1000000;
+	uint32_t max_steps = 1000;
+	uint64_t seed = 0;
+};
+
+//play every playthrough the options call for (the same ones every time):
+static void play(Playthrough *playthrough, Options const &options, bool check, Stats *stats) {
+	stats->state_visits.assign(playthrough->story.states.size(), 0);
+	stats->edge_uses.assign(playthrough->story.edges.size(), 0);
+	if (options.exhaustive) {
+		playthrough->restart();
+		stats->state_visits[playthrough->current_state] += 1;
+		explore(*playthrough, 0, options.max_steps, check, stats);
+	} else {
+		std::mt19937_64 mt(options.seed);
+		std::vector< uint32_t > triggers;
+		for (uint64_t run = 0; run < options.runs; ++run) {
+			playthrough->restart();
+			stats->state_visits[playthrough->current_state] += 1;
+			uint32_t length = 0;
+			while (true) {
+				live_triggers(*playthrough, &triggers);
+				if (triggers.empty() || length == options.max_steps) break;
+				step(playthrough, triggers[mt() % triggers.size()], stats);
+				length += 1;
+			}
+			stats->record(*playthrough, length, triggers.empty(), check);
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	std::string path = data_path("assets/story");
+	Options options;
+	bool max_steps_given = false;
+
+	bool usage = false;
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		bool has_value = (i + 1 < argc);
+		if (arg == "--runs" && has_value) {
+			options.runs = std::stoull(argv[++i]);
+		} else if (arg == "--exhaustive") {
+			options.exhaustive = true;
+		} else if (arg == "--max-steps" && has_value) {
+			options.max_steps = uint32_t(std::stoul(argv[++i]));
+			max_steps_given = true;
+		} else if (arg == "--seed" && has_value) {
+			options.seed = std::stoull(argv[++i]);
+		} else if (arg.size() > 0 && arg[0] != '-') {
+			path = arg;
+		} else {
+			usage = true;
+		}
+	}
+	if (usage) {
+		std::cerr << "Usage:\n\t" << argv[0] << " [--runs N] [--exhaustive] [--max-steps N] [--seed S] [path/to/story]\n"
+			"Plays N random playthroughs (default 1000000) or, with --exhaustive, every trigger sequence,\n"
+			"stopping at states with no way out or after --max-steps steps (default 1000, or 12 when exhaustive)." << std::endl;
+		return 1;
+	}
+	if (!max_steps_given && options.exhaustive) options.max_steps = 12;
+	bool exhaustive = options.exhaustive;
+	uint32_t max_steps = options.max_steps;
+
+	//the game only checks the parts of the story it uses, so check all of it here:
+	Story story(path);
+	story.validate();
+	Playthrough playthrough(story);
+
+	Stats stats;
+	auto before = std::chrono::high_resolution_clock::now();
+	play(&playthrough, options, false, &stats);
+	auto after = std::chrono::high_resolution_clock::now();
+	double seconds = std::chrono::duration< double >(after - before).count();
+
+	//the same playthroughs again, checking edge liveness after each one:
+	Stats checked;
+	play(&playthrough, options, true, &checked);
+	stats.live_mismatches = checked.live_mismatches;
+
+	//------------ report ------------
+	std::cout << (exhaustive ? "Exhaustive: " : "Random: ") << stats.playthroughs << " playthroughs, " << stats.steps << " steps in " << seconds << "s ("
+		<< (stats.steps / std::max(seconds, 1e-9)) / 1e6 << "M steps/s, " << (stats.playthroughs / std::max(seconds, 1e-9)) / 1e6 << "M playthroughs/s)" << std::endl;
+
+	if (stats.playthroughs > 0) {
+		//length of the playthrough at some fraction of the way through the sorted lengths:
+		auto percentile = [&](double fraction) -> size_t {
+			uint64_t rank = std::min(stats.playthroughs - 1, uint64_t(fraction * stats.playthroughs));
+			uint64_t seen = 0;
+			for (size_t length = 0; length < stats.lengths.size(); ++length) {
+				seen += stats.lengths[length];
+				if (seen > rank) return length;
+			}
+			return stats.lengths.size() - 1;
+		};
+		uint64_t total_length = 0;
+		for (size_t length = 0; length < stats.lengths.size(); ++length) {
+			total_length += length * stats.lengths[length];
+		}
+		std::cout << "Path lengths: min " << percentile(0.0) << ", median " << percentile(0.5) << ", 90% " << percentile(0.9)
+			<< ", 99% " << percentile(0.99) << ", max " << percentile(1.0) << "; mean " << double(total_length) / stats.playthroughs << std::endl;
+		if (stats.cut_off > 0) {
+			std::cout << "  (" << stats.cut_off << " playthroughs were cut off at " << max_steps << " steps)" << std::endl;
+		}
+	}
+
+	uint32_t states_covered = 0;
+	for (uint32_t i = 0; i < story.states.size(); ++i) {
+		if (stats.state_visits[i]) states_covered += 1;
+	}
+	std::cout << "States visited: " << states_covered << " of " << story.states.size() << std::endl;
+	for (uint32_t i = 0; i < story.states.size(); ++i) {
+		if (!stats.state_visits[i]) std::cout << "  never visited: '" << story.states[i].name << "'" << std::endl;
+	}
+
+	uint32_t edges_covered = 0;
+	for (uint32_t i = 0; i < story.edges.size(); ++i) {
+		if (stats.edge_uses[i]) edges_covered += 1;
+	}
+	std::cout << "Transitions taken: " << edges_covered << " of " << story.edges.size() << std::endl;
+	for (uint32_t s = 0; s < story.states.size(); ++s) {
+		for (Story::Edge const &edge : story.states[s].edges) {
+			if (stats.edge_uses[story.edgeIndex(edge)]) continue;
+			std::cout << "  never taken: [" << story.trigger_names[edge.trigger] << "] in '" << story.states[s].name << "' (to '" << story.states[edge.target].name << "')" << std::endl;
+		}
+	}
+
+	if (stats.live_mismatches > 0) {
+		std::cerr << "ERROR: transition liveness was wrong " << stats.live_mismatches << " times (flag dependency index out of date?)" << std::endl;
+		return 1;
+	}
+	return 0;
+}